@@ -0,0 +1,296 @@
+/*******************************************************************************
+ * bench_gridfactory.c
+ *
+ * Micro-benchmarks of the text helpers and cell writers of mod_gridfactory,
+ * run without httpd:
+ *
+ *   make bench
+ *
+ * Each benchmark prints its name, the number of runs and the time per run.
+ *
+ * Copyright (c) 2008 Frederik Orellana, Niels Bohr Institute,
+ * University of Copenhagen. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ *******************************************************************************
+ */
+
+#include "apr_general.h"
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gridfactory_text.h"
+#include "gridfactory_columns.h"
+
+/* Size of the buckets bodies are fed to the PUT parser in, as by core_input_filter. */
+#define BENCH_BUCKET_SIZE 8000
+
+static void report(const char* name, int runs, apr_time_t start, apr_size_t bytes){
+  double usec = (double)(apr_time_now() - start) / runs;
+  if(bytes > 0){
+    printf("%-36s %8d runs %12.1f us/run %8.1f MB/s\n", name, runs, usec, bytes / usec);
+  }
+  else{
+    printf("%-36s %8d runs %12.1f us/run\n", name, runs, usec);
+  }
+}
+
+/**
+ * Body of a node registration with nfields fields of vlen bytes each, some of them
+ * URL encoded, with eol ("\n" or "\r\n") line ends.
+ */
+static char* node_body(apr_pool_t* p, int nfields, int vlen, const char* eol){
+  str_buf b;
+  int i, j;
+  buf_init(&b, p);
+  buf_cat(&b, "identifier: https%3A%2F%2Fnode.example.org%2Fdb%2Fnodes%2F1", eol, NULL);
+  for(i = 0; i < nfields; ++i){
+    buf_puts(&b, apr_psprintf(p, "field%d: ", i));
+    for(j = 0; j < vlen; ++j){
+      buf_puts(&b, j % 16 == 15 ? "+" : j % 31 == 30 ? "%2F" : "a");
+    }
+    buf_puts(&b, eol);
+  }
+  return b.data;
+}
+
+/* Body of a batch PUT of njobs job definitions, separated by empty lines. */
+static char* jobs_body(apr_pool_t* p, int njobs, const char* eol){
+  str_buf b;
+  int i;
+  buf_init(&b, p);
+  for(i = 0; i < njobs; ++i){
+    buf_cat(&b, apr_psprintf(p, "identifier: https%%3A%%2F%%2Fhost%%2Fjobs%%2F%d", i), eol,
+       "csStatus: requested", eol,
+       "runtimeEnvironments: ROOT%2F5.22 PYTHON%2F2.6 ATLAS%2F14.2.0", eol,
+       "inputFileURLs: https%3A%2F%2Fhost%2Fin%2Fa.dat https%3A%2F%2Fhost%2Fin%2Fb.dat", eol,
+       "outFileMapping: out.dat+https%3A%2F%2Fhost%2Fout%2Fout.dat", eol,
+       "userInfo: %2FDC%3Dorg%2FDC%3Dexample%2FCN%3DSome+User", eol,
+       eol, NULL);
+  }
+  return b.data;
+}
+
+/* Parse body like read_input_from_put() does, in buckets. */
+static int parse_body(apr_pool_t* p, const char* body, apr_size_t len, int multi){
+  put_parser pp;
+  apr_size_t off, n;
+  put_parser_init(&pp, p, multi);
+  for(off = 0; off < len; off += n){
+    n = len - off < BENCH_BUCKET_SIZE ? len - off : BENCH_BUCKET_SIZE;
+    put_parse(&pp, body + off, n);
+  }
+  put_parse_end(&pp);
+  return pp.recs->nelts;
+}
+
+static void bench_put(apr_pool_t* p, const char* name, const char* body, int multi, int nrecs,
+   int runs){
+  apr_pool_t* rp;
+  apr_size_t len = strlen(body);
+  apr_time_t start;
+  int i;
+  apr_pool_create(&rp, p);
+  if(parse_body(rp, body, len, multi) != nrecs){
+    fprintf(stderr, "%s: expected %d records\n", name, nrecs);
+    exit(1);
+  }
+  start = apr_time_now();
+  for(i = 0; i < runs; ++i){
+    apr_pool_clear(rp);
+    parse_body(rp, body, len, multi);
+  }
+  report(name, runs, start, len);
+  apr_pool_destroy(rp);
+}
+
+/**
+ * The cell writers of gridfactory_columns.h write to a str_buf here, instead of
+ * the output brigade, so that what is timed is the formatting.
+ */
+struct out_stream {
+  str_buf buf;
+};
+
+static void out_write(out_stream* out, const char* data, apr_size_t len){
+  buf_write(&out->buf, data, len);
+}
+
+/* The columns of jobDefinition. */
+static const char* JOB_COLS[] = {
+  "identifier", "name", "csStatus", "userInfo", "created", "lastModified", "runningSeconds",
+  "ramMb", "opSys", "runtimeEnvironments", "allowedVOs", "virtualize", "nodeId", "providerInfo",
+  "inputFileURLs", "outFileMapping", "executable", "stdoutDest", "stderrDest", "uuid"
+};
+#define JOB_NCOLS (sizeof(JOB_COLS) / sizeof(JOB_COLS[0]))
+
+/**
+ * The public cells of nrows rows as in an XML listing: with the descriptor of each
+ * column built per cell from its name, as the formatters did before column
+ * descriptors, or once per schema, as load_schema() does now.
+ */
+static void xml_cells(apr_pool_t* p, out_stream* out, const column_desc* descs, const char** vals,
+   apr_size_t nrows){
+  column_desc d;
+  apr_size_t row, i;
+  for(row = 0; row < nrows; ++row){
+    for(i = 0; i < JOB_NCOLS; ++i){
+      if(descs == NULL){
+        init_column_desc(p, &d, JOB_COLS[i], JOB_TABLE_NUM);
+      }
+      if(descs == NULL ? d.pub : descs[i].pub){
+        out_xml_cell(out, "\n    ", descs == NULL ? &d : &descs[i], vals[i]);
+      }
+    }
+    out->buf.len = 0;
+  }
+}
+
+/* All cells of nrows rows as in a JSON record. */
+static void json_cells(out_stream* out, const column_desc* descs, const char** vals, apr_size_t nrows){
+  apr_size_t row, i;
+  for(row = 0; row < nrows; ++row){
+    for(i = 0; i < JOB_NCOLS; ++i){
+      out_json_cell(out, i == 0, &descs[i], vals[i]);
+    }
+    out->buf.len = 0;
+  }
+}
+
+static void bench_cells(apr_pool_t* p, apr_size_t nrows, int runs){
+  apr_pool_t* rp;
+  column_desc descs[JOB_NCOLS];
+  const char* vals[JOB_NCOLS];
+  apr_time_t start;
+  out_stream out;
+  apr_size_t i;
+  int run;
+  for(i = 0; i < JOB_NCOLS; ++i){
+    init_column_desc(p, &descs[i], JOB_COLS[i], JOB_TABLE_NUM);
+    vals[i] = descs[i].kind == COL_LIST ? "ROOT/5.22 PYTHON/2.6" :
+       descs[i].kind == COL_OUT_FILE_MAPPING ? "out.dat https://host/out/out.dat" : "2009-01-01 12:00:00";
+  }
+  apr_pool_create(&rp, p);
+  start = apr_time_now();
+  for(run = 0; run < runs; ++run){
+    apr_pool_clear(rp);
+    buf_init(&out.buf, rp);
+    xml_cells(rp, &out, NULL, vals, nrows);
+  }
+  report(apr_psprintf(p, "xml cells by name, %u rows", (unsigned)nrows), runs, start, 0);
+  start = apr_time_now();
+  for(run = 0; run < runs; ++run){
+    apr_pool_clear(rp);
+    buf_init(&out.buf, rp);
+    xml_cells(rp, &out, descs, vals, nrows);
+  }
+  report(apr_psprintf(p, "xml cells by descriptor, %u rows", (unsigned)nrows), runs, start, 0);
+  start = apr_time_now();
+  for(run = 0; run < runs; ++run){
+    apr_pool_clear(rp);
+    buf_init(&out.buf, rp);
+    json_cells(&out, descs, vals, nrows);
+  }
+  report(apr_psprintf(p, "json cells, %u rows", (unsigned)nrows), runs, start, 0);
+  apr_pool_destroy(rp);
+}
+
+/**
+ * A job whose list fields have nentries entries each, formatted as XML elements:
+ * by appending each element with apr_pstrcat(), as list_xml_format() did, and
+ * with out_xml_rec_cell(), as rec_xml_format() does now.
+ */
+
+static const char* LIST_COLS[] = {"runtimeEnvironments", "inputFileURLs", "allowedVOs"};
+#define LIST_NCOLS (sizeof(LIST_COLS) / sizeof(LIST_COLS[0]))
+
+static char* list_by_pstrcat(apr_pool_t* p, const char** vals){
+  char* rec = "";
+  char* tmp_val;
+  char* buffer;
+  char* token;
+  char* last;
+  char* sub_field;
+  apr_size_t i;
+  for(i = 0; i < LIST_NCOLS; ++i){
+    sub_field = apr_pstrndup(p, LIST_COLS[i], strlen(LIST_COLS[i]) - 1);
+    tmp_val = "";
+    buffer = apr_pstrdup(p, vals[i]);
+    for(token = apr_strtok(buffer, " ", &last); token != NULL; token = apr_strtok(NULL, " ", &last)){
+      tmp_val = apr_pstrcat(p, tmp_val, "\n    <", sub_field, ">", token, "</", sub_field, ">", NULL);
+    }
+    rec = apr_pstrcat(p, rec, "\n  <", LIST_COLS[i], ">", tmp_val, "\n  </", LIST_COLS[i], ">", NULL);
+  }
+  return rec;
+}
+
+static char* list_by_cell(apr_pool_t* p, const column_desc* descs, const char** vals){
+  out_stream out;
+  apr_size_t i;
+  buf_init(&out.buf, p);
+  for(i = 0; i < LIST_NCOLS; ++i){
+    out_xml_rec_cell(&out, &descs[i], vals[i]);
+  }
+  return out.buf.data;
+}
+
+static void bench_list(apr_pool_t* p, int nentries, int runs){
+  apr_pool_t* rp;
+  column_desc descs[LIST_NCOLS];
+  const char* vals[LIST_NCOLS];
+  apr_time_t start;
+  str_buf b;
+  apr_size_t i;
+  int j, run;
+  for(i = 0; i < LIST_NCOLS; ++i){
+    init_column_desc(p, &descs[i], LIST_COLS[i], JOB_TABLE_NUM);
+    buf_init(&b, p);
+    for(j = 0; j < nentries; ++j){
+      buf_puts(&b, apr_psprintf(p, j == 0 ? "https://host/in/%d.dat" : " https://host/in/%d.dat", j));
+    }
+    vals[i] = b.data;
+  }
+  apr_pool_create(&rp, p);
+  if(strcmp(list_by_pstrcat(rp, vals), list_by_cell(rp, descs, vals)) != 0){
+    fprintf(stderr, "list formats differ\n");
+    exit(1);
+  }
+  start = apr_time_now();
+  for(run = 0; run < runs; ++run){
+    apr_pool_clear(rp);
+    list_by_pstrcat(rp, vals);
+  }
+  report(apr_psprintf(p, "xml lists by pstrcat, %d entries", nentries), runs, start, 0);
+  start = apr_time_now();
+  for(run = 0; run < runs; ++run){
+    apr_pool_clear(rp);
+    list_by_cell(rp, descs, vals);
+  }
+  report(apr_psprintf(p, "xml lists by cell writer, %d entries", nentries), runs, start, 0);
+  apr_pool_destroy(rp);
+}
+
+int main(int argc, const char* const* argv){
+  apr_pool_t* p;
+  apr_app_initialize(&argc, &argv, NULL);
+  apr_pool_create(&p, NULL);
+
+  bench_put(p, "put node 64x16KB", node_body(p, 64, 16384, "\n"), 0, 1, 50);
+  bench_put(p, "put node 64x16KB CRLF", node_body(p, 64, 16384, "\r\n"), 0, 1, 50);
+  bench_put(p, "put 1000 jobs", jobs_body(p, 1000, "\n"), 1, 1000, 50);
+  bench_put(p, "put 1000 jobs CRLF", jobs_body(p, 1000, "\r\n"), 1, 1000, 50);
+  bench_cells(p, 10000, 20);
+  bench_list(p, 1000, 50);
+
+  apr_pool_destroy(p);
+  apr_terminate();
+  return 0;
+}
@@ -0,0 +1,420 @@
+/*******************************************************************************
+ * gridfactory_columns.h
+ *
+ * The columns of the tables of mod_gridfactory, their descriptors, and the
+ * writers of XML and JSON cells. They are kept apart from the module so that
+ * bench_gridfactory.c can time them without httpd.
+ *
+ * The writers write to an out_stream with out_write(), which the including
+ * file defines: the module streams to the output filters, the benchmark
+ * appends to a str_buf.
+ *
+ * Copyright (c) 2008 Frederik Orellana, Niels Bohr Institute,
+ * University of Copenhagen. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ *******************************************************************************
+ */
+
+#ifndef GRIDFACTORY_COLUMNS_H
+#define GRIDFACTORY_COLUMNS_H
+
+#include "gridfactory_text.h"
+#include "gridfactory_escape.h"
+
+#define JOB_TABLE_NUM 1
+#define HIST_TABLE_NUM 2
+#define NODE_TABLE_NUM 3
+
+/* Name of the identifier column. */
+static const char* ID_COL = "identifier";
+
+/* Name of the indexed column holding the last path component of the identifier,
+ * i.e. the UUID. It is optional; see sql/upgrade_schema.sql. */
+static const char* UUID_COL = "uuid";
+
+/* Name of the status column. */
+static const char* STATUS_COL = "csStatus";
+
+/* Name of the name column. */
+static const char* NAME_COL = "name";
+
+/* Name of the host column. */
+static const char* HOST_COL = "host";
+
+/* Name of the subnodes DB URL column. */
+static const char* SUBNODES_DB_URL_COL = "subnodesDbUrl";
+
+/* Name of the lastModified column. */
+static const char* LASTMODIFIED_COL = "lastModified";
+
+/* Name of the providerInfo column. */
+static const char* PROVIDERINFO_COL = "providerInfo";
+
+/* Name of the providerInfo column. */
+static const char* NODEID_COL = "nodeId";
+
+/* Name of the allowedVOs column. */
+static const char* ALLOWED_VOS_COL = "allowedVOs";
+
+/* Name of the hypervisors column. */
+static const char* HYPERVISORS_COL = "hypervisors";
+
+/* Name of the inputFileURLs column. */
+static const char* INPUT_FILE_URLS_COL = "inputFileURLs";
+
+/* Name of the runtimeEnvironments column. */
+static const char* RUNTIME_ENVIRONMENTS_COL = "runtimeEnvironments";
+
+/* Name of the outFileMapping column. */
+static const char* OUT_FILE_MAPPING_COL = "outFileMapping";
+
+/* Name of the DB URL pseudo-column. */
+static const char* DBURL_COL = "dbUrl";
+
+/* Public fields of the jobDefinition table. */
+static char* JOB_PUB_FIELDS_STR = "identifier\tname\tcsStatus\tuserInfo\tcreated\tlastModified\trunningSeconds\tramMb\topSys\truntimeEnvironments\tallowedVOs\tvirtualize\tdbUrl";
+
+/* Public fields of the nodeInformation table. */
+static char* NODE_PUB_FIELDS_STR = "identifier\thost\tsubNodesDbUrl\tmaxJobs\tallowedVOs\tvirtualize\thypervisors\tmaxMBPerJob\tproviderInfo\tcreated\tlastModified\tdbUrl";
+
+static int is_list_field(char* field){
+  // allowedVOs, hypervisors, inputFileURLs, runtimeEnvironments
+  if(strcmp(field, ALLOWED_VOS_COL) == 0){
+    return 1;
+  }
+  else if(strcmp(field, HYPERVISORS_COL) == 0){
+    return 1;
+  }
+  else if(strcmp(field, INPUT_FILE_URLS_COL) == 0){
+    return 1;
+  }
+  else if(strcmp(field, RUNTIME_ENVIRONMENTS_COL) == 0){
+    return 1;
+  }
+  return 0;
+}
+
+static int is_out_file_mapping_field(char* field){
+  if(strcmp(field, OUT_FILE_MAPPING_COL) == 0){
+    return 1;
+  }
+  return 0;
+}
+
+/* Whether field is one of the tab separated fields of fields_str. */
+static int has_field(const char* fields_str, const char* field){
+  apr_size_t len = strlen(field);
+  const char* c = fields_str;
+  while((c = strstr(c, field)) != NULL){
+    if((c == fields_str || c[-1] == '\t') && (c[len] == '\0' || c[len] == '\t')){
+      return 1;
+    }
+    c += len;
+  }
+  return 0;
+}
+
+/* Kinds of columns, by how their values are formatted. */
+static int COL_PLAIN = 0;
+/* Space separated list; see is_list_field(). */
+static int COL_LIST = 1;
+/* Space separated source/destination pairs; see is_out_file_mapping_field(). */
+static int COL_OUT_FILE_MAPPING = 2;
+
+/* Roles of the columns the module looks at. */
+static int ROLE_NONE = 0;
+static int ROLE_ID = 1;
+static int ROLE_NAME = 2;
+static int ROLE_STATUS = 3;
+static int ROLE_HOST = 4;
+static int ROLE_SUBNODES_DB_URL = 5;
+static int ROLE_LASTMODIFIED = 6;
+static int ROLE_PROVIDERINFO = 7;
+static int ROLE_UUID = 8;
+
+/**
+ * Descriptor of a column, built when the schema is loaded, so that formatting
+ * a cell needs no string comparisons.
+ */
+typedef struct {
+  const char* name;
+  int kind;
+  int role;
+  /* Whether the column is one of the public fields of the table. */
+  int pub;
+  /* <name> and </name>. */
+  const char* open_tag;
+  apr_size_t open_len;
+  const char* close_tag;
+  apr_size_t close_len;
+  /* Element of each item of a list column in XML: the name without the plural 's'. */
+  const char* item_name;
+  /* "name": for JSON. */
+  const char* json_key;
+  apr_size_t json_key_len;
+} column_desc;
+
+/* Fill in the descriptor of the column name of table table_num. */
+static void init_column_desc(apr_pool_t* sp, column_desc* d, const char* name, int table_num){
+  apr_size_t len = strlen(name);
+  d->name = name;
+  d->kind = is_list_field((char*)name) ? COL_LIST :
+     is_out_file_mapping_field((char*)name) ? COL_OUT_FILE_MAPPING : COL_PLAIN;
+  d->role = strcmp(name, ID_COL) == 0 ? ROLE_ID :
+     strcmp(name, NAME_COL) == 0 ? ROLE_NAME :
+     strcmp(name, STATUS_COL) == 0 ? ROLE_STATUS :
+     strcmp(name, HOST_COL) == 0 ? ROLE_HOST :
+     strcmp(name, SUBNODES_DB_URL_COL) == 0 ? ROLE_SUBNODES_DB_URL :
+     strcmp(name, LASTMODIFIED_COL) == 0 ? ROLE_LASTMODIFIED :
+     strcmp(name, PROVIDERINFO_COL) == 0 ? ROLE_PROVIDERINFO :
+     strcmp(name, UUID_COL) == 0 ? ROLE_UUID : ROLE_NONE;
+  d->pub = d->role != ROLE_UUID &&
+     has_field(table_num == NODE_TABLE_NUM ? NODE_PUB_FIELDS_STR : JOB_PUB_FIELDS_STR, name);
+  d->open_tag = apr_pstrcat(sp, "<", name, ">", NULL);
+  d->open_len = len + 2;
+  d->close_tag = apr_pstrcat(sp, "</", name, ">", NULL);
+  d->close_len = len + 3;
+  d->item_name = apr_pstrndup(sp, name, len > 0 ? len - 1 : 0);
+  d->json_key = apr_pstrcat(sp, "\"", name, "\":", NULL);
+  d->json_key_len = len + 3;
+}
+
+/**
+ * Cell writers
+ */
+
+typedef struct out_stream out_stream;
+
+/* Write len bytes of data; defined by the including file. */
+static void out_write(out_stream* out, const char* data, apr_size_t len);
+
+/* What a NULL cell is written as - this is what sprintf("%s", NULL) gave. */
+static const char* NULL_VAL_STR = "(null)";
+
+static void out_puts(out_stream* out, const char* str){
+  if(str == NULL){
+    str = NULL_VAL_STR;
+  }
+  out_write(out, str, strlen(str));
+}
+
+/**
+ * Output escaping
+ *
+ * Database values are escaped as they are written, in runs between the
+ * bytes found by esc_scan(); see gridfactory_escape.h.
+ */
+
+/* Write len bytes of val as XML character data. */
+static void out_xml_str(out_stream* out, const char* val, apr_size_t len){
+  const char* end = val + len;
+  const char* run = val;
+  const char* c = val;
+  const char* ent;
+  while((c = esc_scan(c, end, 0)) < end){
+    ent = xml_entity(*c);
+    if(ent == NULL){
+      ++c;
+      continue;
+    }
+    out_write(out, run, c - run);
+    out_puts(out, ent);
+    run = ++c;
+  }
+  out_write(out, run, end - run);
+}
+
+static void out_xml_puts(out_stream* out, const char* val){
+  if(val == NULL){
+    val = NULL_VAL_STR;
+  }
+  out_xml_str(out, val, strlen(val));
+}
+
+/* Write the cell val of column d as <name>val</name>. */
+static void out_xml_cell(out_stream* out, const char* indent, const column_desc* d, const char* val){
+  out_puts(out, indent);
+  out_write(out, d->open_tag, d->open_len);
+  out_xml_puts(out, val);
+  out_write(out, d->close_tag, d->close_len);
+}
+
+/* Write <name>val</name>, preceded by indent. */
+static void out_xml_elem(out_stream* out, const char* indent, const char* name, const char* val){
+  out_puts(out, indent);
+  out_puts(out, "<");
+  out_puts(out, name);
+  out_puts(out, ">");
+  out_xml_puts(out, val);
+  out_puts(out, "</");
+  out_puts(out, name);
+  out_puts(out, ">");
+}
+
+/* Write len bytes of val as a JSON string, escaping in runs rather than per character. */
+static void out_json_str(out_stream* out, const char* val, apr_size_t len){
+  static const char hex[] = "0123456789abcdef";
+  char esc[6] = {'\\', 'u', '0', '0', '0', '0'};
+  const char* end = val + len;
+  const char* run = val;
+  const char* c;
+  out_write(out, "\"", 1);
+  for(c = val; (c = esc_scan(c, end, 1)) < end; ++c){
+    out_write(out, run, c - run);
+    run = c + 1;
+    switch(*c){
+      case '"':
+        out_write(out, "\\\"", 2);
+        break;
+      case '\\':
+        out_write(out, "\\\\", 2);
+        break;
+      case '\n':
+        out_write(out, "\\n", 2);
+        break;
+      case '\r':
+        out_write(out, "\\r", 2);
+        break;
+      case '\t':
+        out_write(out, "\\t", 2);
+        break;
+      default:
+        esc[4] = hex[(*c >> 4) & 0xf];
+        esc[5] = hex[*c & 0xf];
+        out_write(out, esc, 6);
+    }
+  }
+  out_write(out, run, end - run);
+  out_write(out, "\"", 1);
+}
+
+/**
+ * Write a space separated list as a JSON array of strings or, with pairs set,
+ * as an array of {"source": ..., "destination": ...} objects, like outFileMapping.
+ */
+static void out_json_list(out_stream* out, const char* val, int pairs){
+  const char* c = val;
+  const char* start;
+  apr_size_t len;
+  int n = 0;
+  out_write(out, "[", 1);
+  while((start = next_token(&c, &len)) != NULL){
+    if(pairs && n % 2 == 0){
+      out_puts(out, n == 0 ? "{\"source\":" : ",{\"source\":");
+    }
+    else if(pairs){
+      out_puts(out, ",\"destination\":");
+    }
+    else if(n > 0){
+      out_write(out, ",", 1);
+    }
+    out_json_str(out, start, len);
+    if(pairs && n % 2 == 1){
+      out_write(out, "}", 1);
+    }
+    ++n;
+  }
+  if(pairs && n % 2 == 1){
+    out_puts(out, ",\"destination\":null}");
+  }
+  out_write(out, "]", 1);
+}
+
+/* Write "field":val, preceded by a comma unless first. */
+static void out_json_field(out_stream* out, int first, const char* field, const char* val){
+  if(!first){
+    out_write(out, ",", 1);
+  }
+  out_json_str(out, field, strlen(field));
+  out_write(out, ":", 1);
+  if(val == NULL){
+    out_puts(out, "null");
+  }
+  else{
+    out_json_str(out, val, strlen(val));
+  }
+}
+
+/* Write the cell val of column d as "name":val, preceded by a comma unless first.
+   List fields become arrays. */
+static void out_json_cell(out_stream* out, int first, const column_desc* d, const char* val){
+  if(!first){
+    out_write(out, ",", 1);
+  }
+  out_write(out, d->json_key, d->json_key_len);
+  if(val == NULL){
+    out_puts(out, "null");
+  }
+  else if(d->kind == COL_LIST){
+    out_json_list(out, val, 0);
+  }
+  else if(d->kind == COL_OUT_FILE_MAPPING){
+    out_json_list(out, val, 1);
+  }
+  else{
+    out_json_str(out, val, strlen(val));
+  }
+}
+
+/* Write one <sub_field> element per space separated entry of val. */
+static void out_xml_list(out_stream* out, const char* val, const char* sub_field){
+  const char* c = val;
+  const char* start;
+  apr_size_t len;
+  while((start = next_token(&c, &len)) != NULL){
+    out_puts(out, "\n    <");
+    out_puts(out, sub_field);
+    out_write(out, ">", 1);
+    out_xml_str(out, start, len);
+    out_write(out, "</", 2);
+    out_puts(out, sub_field);
+    out_write(out, ">", 1);
+  }
+  out_write(out, "\n  ", 3);
+}
+
+/* Write source/destination elements for the space separated pairs of val. */
+static void out_xml_file_map(out_stream* out, const char* val){
+  const char* c = val;
+  const char* start;
+  apr_size_t len;
+  int source = 1;
+  while((start = next_token(&c, &len)) != NULL){
+    out_puts(out, source ? "\n    <source>" : "<destination>");
+    out_xml_str(out, start, len);
+    out_puts(out, source ? "</source>" : "</destination>");
+    source = !source;
+  }
+  if(!source){
+    out_puts(out, "<destination></destination>");
+  }
+  out_write(out, "\n  ", 3);
+}
+
+/**
+ * Write the cell val of column d of a single record as <name>val</name>. List fields
+ * and outFileMapping are expanded into one element per entry.
+ */
+static void out_xml_rec_cell(out_stream* out, const column_desc* d, const char* val){
+  out_write(out, "\n  ", 3);
+  out_write(out, d->open_tag, d->open_len);
+  // Format allowedVOs, hypervisors, inputFileURLs, runtimeEnvironments
+  if(d->kind == COL_LIST){
+    out_xml_list(out, val, d->item_name);
+  }
+  // Format outFileMapping
+  else if(d->kind == COL_OUT_FILE_MAPPING){
+    out_xml_file_map(out, val);
+  }
+  else{
+    out_xml_puts(out, val);
+  }
+  out_write(out, d->close_tag, d->close_len);
+}
+
+#endif
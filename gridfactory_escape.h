@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * gridfactory_escape.h
+ *
+ * Scanning of mod_gridfactory output for bytes to escape in XML and JSON.
+ * Kept apart from the module, and free of APR, so that test_escape.c can
+ * check the SIMD paths against the byte by byte one.
+ *
+ * Copyright (c) 2008 Frederik Orellana, Niels Bohr Institute,
+ * University of Copenhagen. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ *******************************************************************************
+ */
+
+#ifndef GRIDFACTORY_ESCAPE_H
+#define GRIDFACTORY_ESCAPE_H
+
+#if !defined(GRIDFACTORY_NO_SIMD) && defined(__AVX2__)
+#define GRIDFACTORY_AVX2 1
+#include <immintrin.h>
+#elif !defined(GRIDFACTORY_NO_SIMD) && defined(__SSE2__)
+#define GRIDFACTORY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/**
+ * Output escaping
+ *
+ * Database values are escaped as they are written: &, < and > for XML,
+ * quotes, backslashes and control characters for JSON. Most values need
+ * no escaping at all, so esc_scan() looks for the next byte that might,
+ * 32 or 16 bytes at a time with AVX2 or SSE2 when the module is compiled
+ * for them, and everything before it is written in one go.
+ * Define GRIDFACTORY_NO_SIMD to use the byte by byte loop only.
+ */
+
+/* Whether ch may need escaping: see esc_scan(). */
+static int esc_candidate(unsigned char ch, int json){
+  if(ch < 0x20){
+    return 1;
+  }
+  if(json){
+    return ch == '"' || ch == '\\';
+  }
+  return ch == '&' || ch == '<' || ch == '>';
+}
+
+/**
+ * Return the first byte in [c, end) that may need escaping in JSON, with
+ * json set, or XML, or end if there is none. Bytes below 0x20 are returned
+ * for both, also tabs and newlines, which XML leaves alone.
+ */
+static const char* esc_scan(const char* c, const char* end, int json){
+#if defined(GRIDFACTORY_AVX2)
+  const __m256i lim = _mm256_set1_epi8(0x1f);
+  const __m256i a = _mm256_set1_epi8(json ? '"' : '&');
+  const __m256i b = _mm256_set1_epi8(json ? '\\' : '<');
+  const __m256i g = _mm256_set1_epi8(json ? '"' : '>');
+  while(end - c >= 32){
+    __m256i v = _mm256_loadu_si256((const __m256i*)c);
+    __m256i m = _mm256_or_si256(
+       _mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b)),
+       _mm256_or_si256(_mm256_cmpeq_epi8(v, g),
+          _mm256_cmpeq_epi8(_mm256_max_epu8(v, lim), lim)));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+    if(mask != 0){
+      return c + __builtin_ctz(mask);
+    }
+    c += 32;
+  }
+#elif defined(GRIDFACTORY_SSE2)
+  const __m128i lim = _mm_set1_epi8(0x1f);
+  const __m128i a = _mm_set1_epi8(json ? '"' : '&');
+  const __m128i b = _mm_set1_epi8(json ? '\\' : '<');
+  const __m128i g = _mm_set1_epi8(json ? '"' : '>');
+  while(end - c >= 16){
+    __m128i v = _mm_loadu_si128((const __m128i*)c);
+    /* max(v, 0x1f) == 0x1f is an unsigned v <= 0x1f */
+    __m128i m = _mm_or_si128(
+       _mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+       _mm_or_si128(_mm_cmpeq_epi8(v, g),
+          _mm_cmpeq_epi8(_mm_max_epu8(v, lim), lim)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+    if(mask != 0){
+      return c + __builtin_ctz(mask);
+    }
+    c += 16;
+  }
+#endif
+  while(c < end && !esc_candidate((unsigned char)*c, json)){
+    ++c;
+  }
+  return c;
+}
+
+/**
+ * What to write instead of ch in XML character data: an entity, "" for
+ * control characters XML 1.0 cannot represent, or NULL to keep ch.
+ */
+static const char* xml_entity(char ch){
+  switch(ch){
+    case '&':
+      return "&amp;";
+    case '<':
+      return "&lt;";
+    case '>':
+      return "&gt;";
+    case '\t':
+    case '\n':
+    case '\r':
+      return NULL;
+    default:
+      return "";
+  }
+}
+
+#endif
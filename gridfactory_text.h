@@ -0,0 +1,249 @@
+/*******************************************************************************
+ * gridfactory_text.h
+ *
+ * Text helpers of mod_gridfactory that only depend on APR: list tokens,
+ * string buffers and PUT body parsing. They are kept apart from the module so that they can
+ * be built into bench_gridfactory.c without httpd.
+ *
+ * Copyright (c) 2008 Frederik Orellana, Niels Bohr Institute,
+ * University of Copenhagen. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ *******************************************************************************
+ */
+
+#ifndef GRIDFACTORY_TEXT_H
+#define GRIDFACTORY_TEXT_H
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+/**
+ * Return the next space separated token of *c, with its length in *len,
+ * and advance *c past it - or NULL when there are no more. Tokens are spans
+ * of the value itself: nothing is copied or allocated.
+ */
+static const char* next_token(const char** c, apr_size_t* len){
+  const char* start = *c;
+  while(*start == ' '){
+    ++start;
+  }
+  if(*start == '\0'){
+    *c = start;
+    return NULL;
+  }
+  *c = start;
+  while(**c != '\0' && **c != ' '){
+    ++*c;
+  }
+  *len = *c - start;
+  return start;
+}
+
+/**
+ * String buffer
+ *
+ * Text records are built in a pool-backed buffer that doubles
+ * its capacity when full, so building a record is linear in its size
+ * instead of copying everything written so far on each appended field.
+ */
+
+/* Initial capacity of a str_buf. */
+#define STR_BUF_INIT_SIZE 1024
+
+typedef struct str_buf {
+  apr_pool_t* p;
+  char* data;
+  apr_size_t len;
+  apr_size_t cap;
+} str_buf;
+
+static void buf_init(str_buf* b, apr_pool_t* p){
+  b->p = p;
+  b->len = 0;
+  b->cap = STR_BUF_INIT_SIZE;
+  b->data = (char*)apr_palloc(p, b->cap);
+  b->data[0] = '\0';
+}
+
+static void buf_write(str_buf* b, const char* data, apr_size_t len){
+  if(b->len + len + 1 > b->cap){
+    apr_size_t cap = b->cap * 2;
+    char* data_new;
+    while(b->len + len + 1 > cap){
+      cap *= 2;
+    }
+    data_new = (char*)apr_palloc(b->p, cap);
+    memcpy(data_new, b->data, b->len);
+    b->data = data_new;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  b->data[b->len] = '\0';
+}
+
+static void buf_puts(str_buf* b, const char* str){
+  if(str != NULL){
+    buf_write(b, str, strlen(str));
+  }
+}
+
+/* Append a NULL-terminated list of strings, like apr_pstrcat. */
+static void buf_cat(str_buf* b, ...){
+  va_list ap;
+  const char* str;
+  va_start(ap, b);
+  while((str = va_arg(ap, const char*)) != NULL){
+    buf_write(b, str, strlen(str));
+  }
+  va_end(ap);
+}
+
+/**
+ * PUT body parsing
+ *
+ * Bodies are "key: value" lines, URL encoded, with '+' for space. They are
+ * parsed bucket by bucket as they are read, without first collecting the
+ * whole body: each complete line is decoded in one pass straight into its
+ * own pool allocation, which the record hash then points into. Only a line
+ * split between two buckets is copied, to join its parts.
+ */
+
+typedef struct {
+  apr_pool_t* p;
+  /* Whether an empty line starts a new record, as in batch PUTs. */
+  int multi;
+  /* The records read so far, as apr_hash_t*. */
+  apr_array_header_t* recs;
+  /* The record lines go to; NULL until the first line of a record. */
+  apr_hash_t* rec;
+  /* The start of a line continued in the next bucket. */
+  str_buf pending;
+} put_parser;
+
+static void put_parser_init(put_parser* pp, apr_pool_t* p, int multi){
+  pp->p = p;
+  pp->multi = multi;
+  pp->recs = apr_array_make(p, multi ? 16 : 1, sizeof(apr_hash_t*));
+  pp->rec = NULL;
+  buf_init(&pp->pending, p);
+}
+
+static int put_hex(char c){
+  if(c >= '0' && c <= '9'){
+    return c - '0';
+  }
+  c = apr_tolower(c);
+  if(c >= 'a' && c <= 'f'){
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/**
+ * URL decode [c, end) into dst, '+' being a space, after skipping leading
+ * spaces. Returns the end of what was written, which is 0-terminated.
+ */
+static char* put_decode(char* dst, const char* c, const char* end){
+  int hi;
+  int lo;
+  while(c < end && (*c == ' ' || *c == '+')){
+    ++c;
+  }
+  for(; c < end; ++c){
+    if(*c == '+'){
+      *dst++ = ' ';
+    }
+    else if(*c == '%' && end - c > 2 && (hi = put_hex(c[1])) >= 0 && (lo = put_hex(c[2])) >= 0){
+      *dst++ = (char)((hi << 4) | lo);
+      c += 2;
+    }
+    else{
+      *dst++ = *c;
+    }
+  }
+  *dst = '\0';
+  return dst;
+}
+
+static void put_parse_line(put_parser* pp, const char* line, apr_size_t len){
+  const char* end = line + len;
+  const char* sep;
+  const char* c;
+  char* key;
+  char* val;
+  /* Lines may end in CRLF; the \r is part of neither the key nor the value. */
+  if(len > 0 && line[len - 1] == '\r'){
+    --len;
+    --end;
+  }
+  if(len == 0){
+    if(pp->multi){
+      pp->rec = NULL;
+    }
+    return;
+  }
+  for(c = line; c < end && (*c == ' ' || *c == '\t'); ++c);
+  if(c == end){
+    return;
+  }
+  /* The key and the value share one allocation. */
+  key = (char*)apr_palloc(pp->p, len + 2);
+  sep = memchr(line, ':', len);
+  if(sep != NULL){
+    val = put_decode(key, line, sep) + 1;
+    put_decode(val, sep + 1, end);
+  }
+  else{
+    put_decode(key, line, end);
+    val = "";
+  }
+  if(pp->rec == NULL){
+    pp->rec = apr_hash_make(pp->p);
+    APR_ARRAY_PUSH(pp->recs, apr_hash_t*) = pp->rec;
+  }
+  apr_hash_set(pp->rec, key, APR_HASH_KEY_STRING, val);
+}
+
+/* Parse len bytes of the body. */
+static void put_parse(put_parser* pp, const char* data, apr_size_t len){
+  const char* nl;
+  while(len > 0){
+    nl = memchr(data, '\n', len);
+    if(nl == NULL){
+      buf_write(&pp->pending, data, len);
+      return;
+    }
+    if(pp->pending.len > 0){
+      buf_write(&pp->pending, data, nl - data);
+      put_parse_line(pp, pp->pending.data, pp->pending.len);
+      pp->pending.len = 0;
+    }
+    else{
+      put_parse_line(pp, data, nl - data);
+    }
+    len -= nl + 1 - data;
+    data = nl + 1;
+  }
+}
+
+/* Parse what is left of a body not ending in a newline. */
+static void put_parse_end(put_parser* pp){
+  if(pp->pending.len > 0){
+    put_parse_line(pp, pp->pending.data, pp->pending.len);
+    pp->pending.len = 0;
+  }
+}
+
+#endif
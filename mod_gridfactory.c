@@ -37,11 +37,14 @@
  * 
  * The directory "db" should be a symlink to /var/spool/gridfactory.
  * 
- * three configuration directives are available:
+ * nine configuration directives are available:
  * 
  *   PrepareStatements "On|Off"
  *      Whether or not MySQL prepared statements should be used. I don't
- *      really see any reason to set this to Off.
+ *      really see any reason to set this to Off. Statements are prepared
+ *      on first use and cached per connection. With Off, values from
+ *      requests are escaped and quoted into the queries instead, and the
+ *      statement cache is not used. Default: Off.
  * 
  *   DBBaseURL "URL"
  *      The URL served with this module. If this is not specified,
@@ -51,6 +54,47 @@
  *      Where to find job.xsl, jobs.xsl, history.xsl, nodes.xsl and node.xsl.
  *      These are used for formatting the output when ?mode=xsl is used.
  * 
+ *   SchemaCacheTTL "seconds"
+ *      How long the column lists of jobDefinition, jobHistory and
+ *      nodeInformation are cached by each Apache child before being
+ *      re-read with SHOW fields. 0 means never re-read. Default: 300.
+ *      A reload can also be forced with POST /db/stats/?reload=schema.
+ * 
+ *   ResponseCacheTTL "seconds"
+ *      How long list responses are cached in shared memory, for all
+ *      Apache children. Changes made through this module invalidate the
+ *      cached responses of the table; changes made directly in the
+ *      database are seen after at most this many seconds. Default: 0 (off).
+ * 
+ *   ResponseCacheSlots "number"
+ *   ResponseCacheSlotSize "KB"
+ *      The number of cached responses, a multiple of 4, and the max size
+ *      of each; larger responses are not cached. Server-wide only.
+ *      Default: 128 slots of 128 KB.
+ * 
+ *   NodeOwnerCacheTTL "seconds"
+ *      How long each Apache child remembers the creator of a node record,
+ *      so that heartbeats need not look it up. 0 turns this off. Default: 60.
+ * 
+ *   NodeOwnerCacheSize "entries"
+ *      How many node creators each Apache child remembers. Default: 4096.
+ * 
+ * GET requests return text by default; ?format=xml or ?format=json (or
+ * Accept: application/json) select the other formats.
+ * ?fields=identifier,csStatus,... limits the fields returned; only those
+ * are selected from the database.
+ * Listings can be filtered, ordered and limited, e.g.
+ * GET /db/jobs/?csStatus=ready,requested&ramMb<=2048&orderBy=-created&limit=10;
+ * see list_query_args(). GET /db/jobs/?groupBy=csStatus or
+ * GET /db/nodes/?groupBy=allowedVOs&sum=maxJobs return counts instead.
+ * 
+ * GET /db/stats/ returns the counters of the current Apache child.
+ * 
+ * GET /db/jobs/?csStatus=ready&wait=30 waits up to 30 seconds for a ready job
+ * instead of returning an empty list; see wait_for_recs().
+ * 
+ * POST /db/jobs/claim lets a node atomically claim ready jobs; see claim_recs().
+ * PUT /db/jobs/ updates many jobs in one transaction; see batch_update_recs().
  * 
  */
 
@@ -67,95 +111,58 @@
 #include "mod_auth.h"
 #include "apr_md5.h"
 #include "apu_version.h"
+#include "apr_thread_mutex.h"
+#include "apr_base64.h"
+#include "apr_atomic.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#include "ap_mpm.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "util_mutex.h"
 
 #include <mysql/mysql.h>
+#include <zlib.h>
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <unistd.h>
 
-#define JOB_TABLE_NUM 1
-#define HIST_TABLE_NUM 2
-#define NODE_TABLE_NUM 3
+#include "gridfactory_text.h"
+#include "gridfactory_escape.h"
+#include "gridfactory_columns.h"
 
 #define MY_POOL_MAX_FREE_SIZE 128
 
-/* Apache environment variable. This is used to get the DN used for authorizing
+/* mod_ssl variable. This is used to get the DN used for authorizing
  * node updates. */
 static const char* CLIENT_S_DN_STRING = "SSL_CLIENT_S_DN";
 
+/* Default number of seconds the creator of a node record is remembered by each Apache child. */
+static int DEFAULT_NODE_OWNER_TTL = 60;
+
+/* Default max number of node creators remembered by each Apache child. */
+static int DEFAULT_NODE_OWNER_CACHE_SIZE = 4096;
+
 /* The sub-directory containing the job information. */
 static const char* JOB_DIR = "/jobs/";
 /* The sub-directory containing the job history. */
 static const char* HIST_DIR = "/history/";
 /* The sub-directory containing the node information. */
 static const char* NODE_DIR = "/nodes/";
+/* The sub-directory serving the counters of this process. */
+static const char* STATS_DIR = "/stats/";
 
-/* Keys in the has table of prepared statements. */
-static const char* LABEL = "gridfactory_dbd_0";
-static const char* LABEL1 = "gridfactory_dbd_1";
-static const char* LABEL2 = "gridfactory_dbd_2";
-static const char* LABEL3 = "gridfactory_dbd_3";
-
-/* Name of the identifier column. */
-static const char* ID_COL = "identifier";
-
-/* Column holding the identifier. */
-static int id_col_nr;
+/* Key of the statement cache in the pool of a database connection. */
+static const char* STMT_CACHE_KEY = "gridfactory_stmt_cache";
 
-/* Name of the status column. */
-static const char* STATUS_COL = "csStatus";
-
-/* Name of the name column. */
-static const char* NAME_COL = "name";
-
-/* Name of the host column. */
-static const char* HOST_COL = "host";
-
-/* Name of the subnodes DB URL column. */
-static const char* SUBNODES_DB_URL_COL = "subnodesDbUrl";
+/* Key of the compiled list query arguments in the userdata of the request pool. */
+static const char* LIST_QUERY_KEY = "gridfactory_list_query";
 
 /* ready value of the status column. */
 static const char* READY = "ready";
 
-/* Name of the lastModified column. */
-static const char* LASTMODIFIED_COL = "lastModified";
-
-/* Name of the providerInfo column. */
-static const char* PROVIDERINFO_COL = "providerInfo";
-
-/* Name of the providerInfo column. */
-static const char* NODEID_COL = "nodeId";
-
-/* Name of the allowedVOs column. */
-static const char* ALLOWED_VOS_COL = "allowedVOs";
-
-/* Name of the hypervisors column. */
-static const char* HYPERVISORS_COL = "hypervisors";
-
-/* Name of the inputFileURLs column. */
-static const char* INPUT_FILE_URLS_COL = "inputFileURLs";
-
-/* Name of the runtimeEnvironments column. */
-static const char* RUNTIME_ENVIRONMENTS_COL = "runtimeEnvironments";
-
-/* Name of the outFileMapping column. */
-static const char* OUT_FILE_MAPPING_COL = "outFileMapping";
-
-/* Column holding the name. */
-static int name_col_nr;
-
-/* Column holding the status. */
-static int status_col_nr;
-
-/* Column holding the host. */
-static int host_col_nr;
-
-/* Column holding the subnodes DB URL. */
-static int subnodes_db_url_col_nr;
-
-/* Name of the DB URL pseudo-column. */
-static const char* DBURL_COL = "dbUrl";
-
 /* SQL query to get list of fields. */
 static const char* JOB_REC_SHOW_F_Q = "SHOW fields FROM `jobDefinition`";
 
@@ -165,58 +172,90 @@ static const char* HIST_REC_SHOW_F_Q = "SHOW fields FROM `jobHistory`";
 /* SQL query to get list of fields. */
 static const char* NODE_REC_SHOW_F_Q = "SHOW fields FROM `nodeInformation`";
 
-/* SQL query to get all job definition records. */
-static const char* JOB_RECS_SELECT_Q = "SELECT * FROM `jobDefinition`";
+/* The tables, indexed by table number. */
+static const char* TABLE_NAMES[] = {NULL, "jobDefinition", "jobHistory", "nodeInformation"};
 
-/* SQL query to get all job history records. */
-static const char* HIST_RECS_SELECT_Q = "SELECT * FROM `jobHistory`";
+/* The names of listings of the tables, indexed by table number. */
+static const char* TABLE_LIST_NAMES[] = {NULL, "jobs", "history", "nodes"};
 
-/* SQL query to get all node information records. */
-static const char* NODE_RECS_SELECT_Q = "SELECT * FROM `nodeInformation`";
+/* Query to get the validator of a record; to be followed by a WHERE clause. */
+static const char* REC_VALIDATOR_Q = "SELECT UNIX_TIMESTAMP(lastModified) FROM `%s`";
 
-/* Prepared statement string to get job record. */
-static const char* JOB_REC_SELECT_PS = "SELECT * FROM jobDefinition WHERE identifier LIKE ?";
+/* Query to get the validator of a listing with a LIMIT from its rows only; to be followed
+   by the WHERE clause and the ORDER BY/LIMIT of the listing and RECS_VALIDATOR_END.
+   The checksum of the identifiers tells when rows were replaced by others. */
+static const char* RECS_VALIDATOR_Q = "SELECT UNIX_TIMESTAMP(MAX(lastModified)), COUNT(*), BIT_XOR(CRC32(identifier)) FROM (SELECT lastModified, identifier FROM `%s`";
+static const char* RECS_VALIDATOR_END = ") AS page";
 
-/* Prepared statement string to get history record. */
-static const char* HIST_REC_SELECT_PS = "SELECT * FROM jobHistory WHERE identifier LIKE ?";
+/* Query checking if a listing is non-empty; to be followed by a WHERE clause. */
+static const char* RECS_EXIST_Q = "SELECT 1 FROM `%s`";
 
-/* Prepared statement string to get node record. */
-static const char* NODE_REC_SELECT_PS = "SELECT * FROM nodeInformation WHERE identifier LIKE ?";
+/* Query polled by the watcher; changes when a job is added, changed or becomes ready. */
+static const char* JOB_RECS_WATCH_Q = "SELECT UNIX_TIMESTAMP(MAX(lastModified)), \
+(SELECT COUNT(*) FROM `jobDefinition` WHERE csStatus = 'ready') FROM `jobDefinition`";
 
-/* Query to get job record. */
-static const char* JOB_REC_SELECT_Q = "SELECT * FROM `jobDefinition` WHERE identifier LIKE '%/%s'";
+/* Query to get records, given the select list of a projection and the table;
+   may be followed by a WHERE clause. */
+static const char* RECS_SELECT_Q = "SELECT %s FROM `%s`";
 
-/* Query to get history record. */
-static const char* HIST_REC_SELECT_Q = "SELECT * FROM `jobHistory` WHERE identifier LIKE '%/%s'";
-
-/* Query to get node record. */
-static const char* NODE_REC_SELECT_Q = "SELECT * FROM `nodeInformation` WHERE identifier = '%s'";
-
-/* Prepared statement string to update job record. */
-static const char* JOB_REC_UPDATE_PS_1 = "UPDATE `jobDefinition` SET lastModified = NOW() WHERE identifier LIKE ?";
+/* WHERE clauses finding one record. The value is a statement parameter. */
+static const char* UUID_WHERE = " WHERE uuid = %s";
+static const char* ID_WHERE = " WHERE identifier = %s";
+static const char* ID_LIKE_WHERE = " WHERE identifier LIKE %s";
 
 /* Query to update job record. */
 static const char* JOB_REC_UPDATE_Q = "UPDATE `jobDefinition` SET lastModified = NOW()";
 
-/* Query to update node record. */
+/* Condition restricting a job update to jobs that are not ready, as is_ready() tells. */
+static const char* JOB_NOT_READY_COND = " AND (csStatus IS NULL OR csStatus = '' OR LOCATE(BINARY csStatus, 'ready') = 0)";
+
+
+/* Query to pick ready jobs for a claim, skipping those locked by concurrent claims. */
+static const char* JOB_RECS_CLAIM_Q = "SELECT identifier FROM `jobDefinition` WHERE csStatus = 'ready' ORDER BY created LIMIT %d FOR UPDATE SKIP LOCKED";
+
+/* Query to get claimed job records. */
+static const char* JOB_RECS_CLAIMED_Q = "SELECT %s FROM `jobDefinition` WHERE identifier IN (%s) ORDER BY created";
+
+/* Query to lock the job records of a batch PUT, by UUID. */
+static const char* JOB_RECS_LOCK_UUID_Q = "SELECT identifier, csStatus, uuid FROM `jobDefinition` WHERE uuid IN (%s) FOR UPDATE";
+
+/* Query to lock the job records of a batch PUT. */
+static const char* JOB_RECS_LOCK_Q = "SELECT identifier, csStatus FROM `jobDefinition` WHERE %s FOR UPDATE";
+
+/* Query to create a node record; followed by ON DUPLICATE KEY UPDATE, it also updates
+   it - see NODE_OWNER_COND. That needs a unique index on identifier. */
+static const char* NODE_REC_UPSERT_Q = "INSERT INTO nodeInformation SET created = NOW(), lastModified = NOW(), identifier = %s";
+
+/* Condition for updating an existing node record: it must be created by the client,
+   whose DN is the parameter. */
+static const char* NODE_OWNER_COND = "(providerInfo IS NULL OR providerInfo = %s)";
+
+/* Query to update a node record, when identifier is not a unique key. */
 static const char* NODE_REC_UPDATE_Q = "UPDATE `nodeInformation` SET lastModified = NOW()";
 
-/* Query to create node record. */
-static const char* NODE_REC_INSERT_Q = "INSERT INTO nodeInformation SET created = NOW(), lastModified = NOW()";
+/* Queries serializing node record writes when identifier is not a unique key. */
+static const char* NODE_LOCK_Q = "SELECT GET_LOCK('gridfactory_nodes', 10)";
+static const char* NODE_UNLOCK_Q = "SELECT RELEASE_LOCK('gridfactory_nodes')";
+
+/* Query to get the creator of a node record. */
+static const char* NODE_OWNER_Q = "SELECT providerInfo FROM `nodeInformation` WHERE identifier = %s";
 
 /* Optional function - look it up once in post_config. */
 static ap_dbd_t* (*dbd_acquire_fn)(request_rec*) = NULL;
-static void (*dbd_prepare_fn)(server_rec*, const char*, const char*) = NULL;
+static ap_dbd_t* (*dbd_open_fn)(apr_pool_t*, server_rec*) = NULL;
+static void (*dbd_close_fn)(server_rec*, ap_dbd_t*) = NULL;
 
-/* Max size of each field name. */
-static int MAX_F_SIZE = 256;
+/* From mod_ssl.h, so as not to need it to build. */
+APR_DECLARE_OPTIONAL_FN(char*, ssl_var_lookup,
+   (apr_pool_t*, server_rec*, conn_rec*, request_rec*, char*));
+static char* (*ssl_var_lookup_fn)(apr_pool_t*, server_rec*, conn_rec*, request_rec*, char*) = NULL;
 
 /* Max size of all field names. */
 //static int MAX_T_F_SIZE = 5120;
 
-/* Max size (bytes) of response and PUT bodies.
+/* Max size (bytes) of PUT bodies.
  * This is to protect against memory leaking.
- * Notice that it should be MAX_SELECT_ROWS * [longest expected row]*/
+ * List responses are streamed and not limited by this. */
 static int MAX_SIZE = 10000000;
 
 /* Max number of rows that we will return from a DB query.
@@ -247,11 +286,110 @@ static char* TEXT_FORMAT_STR = "text";
 /* XML format directive. */
 static char* XML_FORMAT_STR = "xml";
 
-/* Public fields of the jobDefinition table. */
-static char* JOB_PUB_FIELDS_STR = "identifier\tname\tcsStatus\tuserInfo\tcreated\tlastModified\trunningSeconds\tramMb\topSys\truntimeEnvironments\tallowedVOs\tvirtualize\tdbUrl";
+/* JSON format directive. */
+static char* JSON_FORMAT_STR = "json";
+
+/* Media type of JSON output; also looked for in the Accept header. */
+static const char* JSON_CONTENT_TYPE = "application/json";
+
+/* Fields shown in XML listings of jobDefinition and jobHistory. */
+static const char* JOB_XML_FIELDS_STR = "identifier\tname\tcsStatus";
+
+/* Fields shown in XML listings of nodeInformation. */
+static const char* NODE_XML_FIELDS_STR = "identifier\thost\tsubNodesDbUrl";
+
+/* String to use in GET request to select the fields returned, e.g. fields=identifier,csStatus. */
+static const char* FIELDS_STR = "fields";
+
+/* String to use in GET request to order a listing, e.g. orderBy=created,-ramMb. */
+static const char* ORDER_BY_STR = "orderBy";
+
+/* String to use in GET request to count records per value of a column, e.g. groupBy=csStatus. */
+static const char* GROUP_BY_STR = "groupBy";
+
+/* String to use in GET request to count the records, count=1. */
+static const char* COUNT_STR = "count";
+
+/* String to use in GET request to add up a column in counts, e.g. sum=maxJobs. */
+static const char* SUM_STR = "sum";
+
+/* Columns which can be added up. */
+static const char* SUM_FIELDS_STR = "maxJobs\tmaxMBPerJob\tramMb\trunningSeconds";
+
+/* Columns which can be filtered by range, e.g. ramMb>=1024. */
+static const char* RANGE_FIELDS_STR = "lastModified\tcreated\tramMb";
+
+/* String to use in GET request to require the page following a given cursor. */
+static char* AFTER_STR = "after";
+
+/* String to use in GET request to require a given page size. */
+static char* LIMIT_STR = "limit";
+
+/* String to use in POST /db/jobs/claim to require a max number of jobs. */
+static char* MAX_STR = "max";
+
+/* Last path component of the job claim URL. */
+static const char* CLAIM_STR = "/claim";
+
+/* Max number of jobs that can be claimed with one request. */
+static int MAX_CLAIM = 100;
+
+/* Status given to claimed jobs when the request body does not set csStatus. */
+static const char* REQUESTED = "requested";
+
+/* Max number of records in one batch PUT. */
+static int MAX_BATCH = 1000;
+
+/* Per-record results of a batch PUT. */
+static const char* BATCH_UPDATED = "updated";
+static const char* BATCH_NOT_FOUND = "notFound";
+static const char* BATCH_REFUSED = "refused";
+static const char* BATCH_INVALID = "invalid";
+
+/* Name of the result column/element of a batch PUT. */
+static const char* RESULT_STR = "result";
+
+/* Name of the next-page cursor in list output. */
+static char* NEXT_PAGE_STR = "nextPage";
+
+/* Page size used with 'after' when 'limit' is not given. */
+static int DEFAULT_PAGE_SIZE = 1000;
+
+/* Argument making a job listing wait for a matching record, e.g. ?csStatus=ready&wait=30. */
+static const char* WAIT_STR = "wait";
+
+/* Maximum number of seconds a listing may wait. */
+static int MAX_WAIT = 60;
+
+/* How often a waiting request on an event MPM checks if jobDefinition changed.
+ * This only looks at the watcher, not at the database. */
+static const apr_interval_time_t WAIT_POLL_INTERVAL = 250000;
+
+/* How often the watcher of each Apache child polls jobDefinition while requests are waiting. */
+static const apr_interval_time_t WATCH_INTERVAL = 1000000;
 
-/* Public fields of the nodeInformation table. */
-static char* NODE_PUB_FIELDS_STR = "identifier\thost\tsubNodesDbUrl\tmaxJobs\tallowedVOs\tvirtualize\thypervisors\tmaxMBPerJob\tproviderInfo\tcreated\tlastModified\tdbUrl";
+/* String to use in POST /db/stats/ to force a reload, e.g. reload=schema. */
+static char* RELOAD_STR = "reload";
+
+/* Value of RELOAD_STR forcing the cached table schemas to be re-read. */
+static char* RELOAD_SCHEMA_STR = "schema";
+
+/* Cache-Control of history records - they never change. */
+static const char* HIST_CACHE_CONTROL = "public, max-age=31536000";
+
+/* Default number of seconds a cached table schema is used before re-reading it. */
+static int DEFAULT_SCHEMA_TTL = 300;
+
+/* Defaults of ResponseCacheSlots and ResponseCacheSlotSize. */
+#define DEFAULT_RESPONSE_CACHE_SLOTS 128
+#define DEFAULT_RESPONSE_CACHE_SLOT_SIZE (128 * 1024)
+
+/* Number of slots a response can be cached in; ResponseCacheSlots must be a multiple. */
+#define RESPONSE_CACHE_WAYS 4
+
+/* Set by ResponseCacheSlots and ResponseCacheSlotSize, for the whole server. */
+static int response_cache_slots = DEFAULT_RESPONSE_CACHE_SLOTS;
+static apr_size_t response_cache_slot_size = DEFAULT_RESPONSE_CACHE_SLOT_SIZE;
 
 /* Value indicating output should be text formatted. */
 static int TEXT_FORMAT = 0;
@@ -259,11 +397,14 @@ static int TEXT_FORMAT = 0;
 /* Value indicating output should be XML formatted. */
 static int XML_FORMAT = 1;
 
-/* Base URL for the DB web service. */
-char* base_url;
+/* Value indicating output should be JSON formatted. */
+static int JSON_FORMAT = 2;
 
-/* URL to directory containing job.xsl, jobs.xsl, history.xsl, node.xsl and nodes.xsl. */
-char* xsl_dir;
+/* Default URL of the directory containing job.xsl, jobs.xsl, history.xsl, node.xsl and nodes.xsl. */
+static const char* DEFAULT_XSL_DIR = "/gridfactory/xsl/";
+
+/* Path of the records of each table below the base URL, indexed by table number. */
+static const char* TABLE_DIRS[] = {"", "/jobs/", "/history/", "/nodes/"};
 
 /* Forward declaration */
 module AP_MODULE_DECLARE_DATA gridfactory_module;
@@ -277,8 +418,37 @@ typedef struct {
   char* ps_;
   char* url_;
   char* xsl_;
+  /* Seconds; -1 when SchemaCacheTTL was not set. */
+  int schema_ttl_;
+  /* Seconds; -1 when ResponseCacheTTL was not set. */
+  int response_ttl_;
+  /* Seconds; -1 when NodeOwnerCacheTTL was not set. */
+  int node_owner_ttl_;
+  /* Entries; -1 when NodeOwnerCacheSize was not set. */
+  int node_owner_cache_size_;
+  /* url_ followed by the path of each table; all NULL when DBBaseURL was not set. */
+  char* base_urls_[NODE_TABLE_NUM + 1];
 } config_rec;
 
+/**
+ * Per-request state. Kept in the request_config of the request and allocated from its
+ * pool, so it lives as long as the request - also when the request is suspended - and
+ * is never seen by other requests or threads.
+ */
+typedef struct {
+  int table_num;
+  /* Base URL of the records of the table, e.g. https://this.server/db/jobs/. */
+  const char* base_url;
+  /* URL of the directory holding the XSL stylesheets. */
+  const char* xsl_dir;
+  /* Set while waiting for a listing to become non-empty; see wait_for_recs(). */
+  struct wait_state* wait;
+} request_ctx;
+
+static request_ctx* get_ctx(request_rec* r){
+  return (request_ctx*)ap_get_module_config(r->request_config, &gridfactory_module);
+}
+
 static void*
 do_config(apr_pool_t* p, char* d)
 {
@@ -292,11 +462,17 @@ do_config(apr_pool_t* p, char* d)
         return "You must load mod_dbd to use mod_gridfactory";
     }
   }
-  dbd_prepare_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_prepare);
+  dbd_open_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_open);
+  dbd_close_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_close);
+  ssl_var_lookup_fn = APR_RETRIEVE_OPTIONAL_FN(ssl_var_lookup);
   config_rec* conf = (config_rec*)apr_pcalloc(p, sizeof(config_rec));
   conf->ps_ = 0;      /* null pointer */
   conf->url_ = 0;      /* null pointer */
   conf->xsl_ = 0;      /* null pointer */
+  conf->schema_ttl_ = -1;
+  conf->response_ttl_ = -1;
+  conf->node_owner_ttl_ = -1;
+  conf->node_owner_cache_size_ = -1;
   return conf;
 }
 
@@ -304,15 +480,6 @@ do_config(apr_pool_t* p, char* d)
  * DB stuff
  */
 
-static void
-dbd_prepare(cmd_parms* cmd, void* cfg)
-{
-    dbd_prepare_fn(cmd->server, JOB_REC_SELECT_PS, LABEL);
-    dbd_prepare_fn(cmd->server, JOB_REC_UPDATE_PS_1, LABEL1);
-    dbd_prepare_fn(cmd->server, HIST_REC_SELECT_PS, LABEL2);
-    dbd_prepare_fn(cmd->server, NODE_REC_SELECT_PS, LABEL3);
- }
-
 static const char*
 config_ps(cmd_parms* cmd, void* mconfig, const char* arg)
 {
@@ -321,20 +488,23 @@ config_ps(cmd_parms* cmd, void* mconfig, const char* arg)
 
   ((config_rec*)mconfig)->ps_ = (char*) arg;
 
-  if(apr_strnatcasecmp(((config_rec*)mconfig)->ps_, "On") == 0){
-    dbd_prepare(cmd, mconfig);
-  }
-
   return 0;
 }
 
 static const char*
 config_url(cmd_parms* cmd, void* mconfig, const char* arg)
 {
+  int i;
   if(((config_rec*)mconfig)->url_){
     return "DBBaseURL already set.";
   }
   ((config_rec*)mconfig)->url_ = (char*) arg;
+  /* The base URLs do not depend on the request, so they are only built once. */
+  if(*arg != '\0'){
+    for(i = JOB_TABLE_NUM; i <= NODE_TABLE_NUM; ++i){
+      ((config_rec*)mconfig)->base_urls_[i] = apr_pstrcat(cmd->pool, arg, TABLE_DIRS[i], NULL);
+    }
+  }
   return 0;
 }
 
@@ -348,18 +518,117 @@ config_xsl(cmd_parms* cmd, void* mconfig, const char* arg)
   return 0;
 }
 
+static const char*
+config_schema_ttl(cmd_parms* cmd, void* mconfig, const char* arg)
+{
+  if(((config_rec*)mconfig)->schema_ttl_ >= 0){
+    return "SchemaCacheTTL already set.";
+  }
+  ((config_rec*)mconfig)->schema_ttl_ = atoi(arg);
+  if(((config_rec*)mconfig)->schema_ttl_ < 0){
+    return "SchemaCacheTTL must be a number of seconds >= 0.";
+  }
+  return 0;
+}
+
+static const char*
+config_response_ttl(cmd_parms* cmd, void* mconfig, const char* arg)
+{
+  if(((config_rec*)mconfig)->response_ttl_ >= 0){
+    return "ResponseCacheTTL already set.";
+  }
+  ((config_rec*)mconfig)->response_ttl_ = atoi(arg);
+  if(((config_rec*)mconfig)->response_ttl_ < 0){
+    return "ResponseCacheTTL must be a number of seconds >= 0.";
+  }
+  return 0;
+}
+
+static const char*
+config_node_owner_ttl(cmd_parms* cmd, void* mconfig, const char* arg)
+{
+  if(((config_rec*)mconfig)->node_owner_ttl_ >= 0){
+    return "NodeOwnerCacheTTL already set.";
+  }
+  ((config_rec*)mconfig)->node_owner_ttl_ = atoi(arg);
+  if(((config_rec*)mconfig)->node_owner_ttl_ < 0){
+    return "NodeOwnerCacheTTL must be a number of seconds >= 0.";
+  }
+  return 0;
+}
+
+static const char*
+config_node_owner_cache_size(cmd_parms* cmd, void* mconfig, const char* arg)
+{
+  if(((config_rec*)mconfig)->node_owner_cache_size_ >= 0){
+    return "NodeOwnerCacheSize already set.";
+  }
+  ((config_rec*)mconfig)->node_owner_cache_size_ = atoi(arg);
+  if(((config_rec*)mconfig)->node_owner_cache_size_ < 1){
+    return "NodeOwnerCacheSize must be a number of entries >= 1.";
+  }
+  return 0;
+}
+
+static const char*
+config_response_slots(cmd_parms* cmd, void* mconfig, const char* arg)
+{
+  const char* err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  int n = atoi(arg);
+  if(err != NULL){
+    return err;
+  }
+  if(n < RESPONSE_CACHE_WAYS || n % RESPONSE_CACHE_WAYS != 0){
+    return "ResponseCacheSlots must be a positive multiple of 4.";
+  }
+  response_cache_slots = n;
+  return 0;
+}
+
+static const char*
+config_response_slot_size(cmd_parms* cmd, void* mconfig, const char* arg)
+{
+  const char* err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  int kb = atoi(arg);
+  if(err != NULL){
+    return err;
+  }
+  if(kb < 1){
+    return "ResponseCacheSlotSize must be a number of KB >= 1.";
+  }
+  response_cache_slot_size = (apr_size_t)kb * 1024;
+  return 0;
+}
 
 static const command_rec command_table[] =
 {
     AP_INIT_TAKE1("PrepareStatements", config_ps,
                   NULL, OR_FILEINFO,
-                  "Whether or not to use prepared statements."),
+                  "Whether or not to use prepared statements, cached per connection. Default: Off."),
     AP_INIT_TAKE1("DBBaseURL", config_url,
                   NULL, OR_FILEINFO,
                   "Base URL of the DB web service."),
     AP_INIT_TAKE1("XSLDirURL", config_xsl,
                   NULL, OR_FILEINFO,
                   "Where to get XSL files for formatting XML output."),
+    AP_INIT_TAKE1("SchemaCacheTTL", config_schema_ttl,
+                  NULL, OR_FILEINFO,
+                  "Seconds to cache the column lists of the DB tables."),
+    AP_INIT_TAKE1("ResponseCacheTTL", config_response_ttl,
+                  NULL, OR_FILEINFO,
+                  "Seconds to cache list responses in shared memory. 0 turns the cache off."),
+    AP_INIT_TAKE1("ResponseCacheSlots", config_response_slots,
+                  NULL, RSRC_CONF,
+                  "Number of list responses cached in shared memory; a multiple of 4."),
+    AP_INIT_TAKE1("ResponseCacheSlotSize", config_response_slot_size,
+                  NULL, RSRC_CONF,
+                  "Max size in KB of a cached list response; larger ones are not cached."),
+    AP_INIT_TAKE1("NodeOwnerCacheTTL", config_node_owner_ttl,
+                  NULL, OR_FILEINFO,
+                  "Seconds to remember the creator of a node record. 0 turns this off."),
+    AP_INIT_TAKE1("NodeOwnerCacheSize", config_node_owner_cache_size,
+                  NULL, OR_FILEINFO,
+                  "Max number of node record creators remembered by each Apache child."),
     {NULL}
 };
 
@@ -410,6 +679,55 @@ void urldecode2(char *dst, const char *src)
 	*dst++ = '\0';
 }
 
+/**
+ * Get the value of a query argument, or NULL if it is not present.
+ * An argument without '=' has the value "".
+ */
+char* get_arg(apr_pool_t* p, const char* args, const char* name){
+  const char* arg = args;
+  apr_size_t len = strlen(name);
+  const char* end;
+  while(arg != NULL && *arg != '\0'){
+    end = strchr(arg, '&');
+    if(strncmp(arg, name, len) == 0 && (arg[len] == '=' || arg[len] == '&' || arg[len] == '\0')){
+      if(arg[len] != '='){
+        return "";
+      }
+      arg += len + 1;
+      return end == NULL ? apr_pstrdup(p, arg) : apr_pstrndup(p, arg, end - arg);
+    }
+    arg = end == NULL ? NULL : end + 1;
+  }
+  return NULL;
+}
+
+/**
+ * The format asked for with ?format=text|xml|json or else with
+ * Accept: application/json. Defaults to text.
+ */
+static int request_format(apr_pool_t* p, request_rec* r){
+  const char* val = r->args ? get_arg(p, r->args, FORMAT_STR) : NULL;
+  const char* accept;
+  if(val != NULL){
+    if(apr_strnatcmp(val, TEXT_FORMAT_STR) == 0){
+      return TEXT_FORMAT;
+    }
+    else if(apr_strnatcmp(val, XML_FORMAT_STR) == 0){
+      return XML_FORMAT;
+    }
+    else if(apr_strnatcmp(val, JSON_FORMAT_STR) == 0){
+      return JSON_FORMAT;
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Format %s unknown.", val);
+    return TEXT_FORMAT;
+  }
+  accept = apr_table_get(r->headers_in, "Accept");
+  if(accept != NULL && strstr(accept, JSON_CONTENT_TYPE) != NULL){
+    return JSON_FORMAT;
+  }
+  return TEXT_FORMAT;
+}
+
 /* From apr_dbd_mysql.c */
 /*struct apr_dbd_results_t {
     int random;
@@ -431,91 +749,127 @@ typedef struct {
     /* Used only by update_rec to check if a node record
      * was created by the user trying to modify it. */
     char* providerInfo;
+    /* Set when the response was already streamed to the client,
+     * instead of being returned in res. */
+    int streamed;
+    /* Set when no body should be sent, e.g. to HTTP_NOT_MODIFIED. */
+    int http_status;
 } db_result;
 
-int tokenize_fields_str(apr_pool_t* p, char* fields_str, char** fields, const char* delim){
+/**
+ * Schema cache
+ *
+ * The column list of each table is read once per Apache child with
+ * SHOW fields and kept in a long-lived pool, instead of being queried
+ * before every GET and PUT.
+ */
 
-  char* field;
-  char* last;
-  int i = 0;
+typedef struct {
+    /* Pool holding this schema; destroyed when the schema is replaced. */
+    apr_pool_t* pool;
+    int cols;
+    /* The column names, in table order. */
+    char** fields;
+    /* Tab separated column names, followed by the pseudo-column 'dbUrl'. */
+    char* fields_str;
+    int id_col_nr;
+    int name_col_nr;
+    int status_col_nr;
+    int host_col_nr;
+    int subnodes_db_url_col_nr;
+    int lastmodified_col_nr;
+    /* The optional uuid column; -1 if the table does not have it. */
+    int uuid_col_nr;
+    /* Whether identifier is a primary or unique key. */
+    int id_unique;
+    /* Requests using the schema; see get_schema(). */
+    int refs;
+    /* Set when the schema was replaced; its pool is destroyed once refs drops to 0. */
+    int retired;
+    /* One per column, in table order. */
+    column_desc* descs;
+    int table_num;
+    apr_time_t loaded;
+    /* The reload generation the schema was loaded in. */
+    apr_uint32_t generation;
+} table_schema;
 
-  // Use a copy of pub_fields_str (it's modified by the tokenizing)
-  char* tmp_fields_str = (char*)apr_pcalloc(p, 512 * sizeof(char*));
-  apr_cpystrn(tmp_fields_str, fields_str, strlen(fields_str)+1);
-  /* Split the fields on "\t" */
-  for(field = apr_strtok(tmp_fields_str, delim, &last); field != NULL;
-      field = apr_strtok(NULL, delim, &last)){
-    //fields[i] = malloc(MAX_F_SIZE * sizeof(char));
-    fields[i] = (char*)apr_pcalloc(p, MAX_F_SIZE * sizeof(char*));
-    if(fields[i] == NULL){
-      ap_log_perror(APLOG_MARK, APLOG_CRIT, 0, p, "Out of memory.");
-      return -1;
-    }
-    apr_cpystrn(fields[i], field, strlen(field)+1);
-    ++i;
+typedef struct {
+    /* Parent of the per-schema pools. Created in child_init. */
+    apr_pool_t* pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t* mutex;
+#endif
+    /* Indexed by table number. */
+    table_schema* tables[NODE_TABLE_NUM + 1];
+    /* Set while a thread re-reads the table; others keep using the old schema. */
+    int loading[NODE_TABLE_NUM + 1];
+    /* Bumped by POST /db/stats/?reload=schema. Points into the shared memory of
+       the response cache, so that all children reload, or else to local_generation. */
+    apr_uint32_t* generation;
+    apr_uint32_t local_generation;
+    apr_uint32_t hits;
+    apr_uint32_t refreshes;
+} schema_cache;
+
+static schema_cache schemas;
+
+static const char* schema_query(int table_num){
+  switch(table_num){
+    case JOB_TABLE_NUM:
+      return JOB_REC_SHOW_F_Q;
+    case HIST_TABLE_NUM:
+      return HIST_REC_SHOW_F_Q;
+    case NODE_TABLE_NUM:
+      return NODE_REC_SHOW_F_Q;
+    default:
+      return NULL;
   }
-
-  return i;
 }
 
-char** set_fields(apr_pool_t* p, ap_dbd_t* dbd, char* fields_str, char* query){
+/**
+ * Read the list of fields of a table into a new schema allocated from sp.
+ * p is only used for the query results.
+ */
+static table_schema* load_schema(apr_pool_t* sp, apr_pool_t* p, ap_dbd_t* dbd, const char* query,
+   int table_num){
 
     apr_status_t rv;
     const char* ret = "";
-    // Hmm, does not work. Memory gets overwritten...
-    //fields_str = apr_pcalloc(p, MAX_T_F_SIZE * sizeof(char));
-    /*fields_str = (char*) malloc(MAX_T_F_SIZE * sizeof(char*));
-    if(fields_str == NULL){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Out of memory.");
-      return NULL;
-    }*/
-
     apr_dbd_results_t *res = NULL;
     apr_dbd_row_t* row;
     char* val;
-    int firstrow = 0;
+    const char* key;
     int i = 0;
     int first_row_num = 1;
     if(APR_VERSION<130){ // @suppress("Symbol is not resolved")
       first_row_num=0;
     }
 
-    /*ap_dbd_t* dbd = (ap_dbd_t*)apr_pcalloc(p, 256 * sizeof(ap_dbd_t*));
-    dbd = dbd_acquire_fn(r);
-    if(dbd == NULL){
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to acquire database connection.");
-        return NULL;
-    }*/
+    table_schema* schema = (table_schema*)apr_pcalloc(sp, sizeof(table_schema));
+    schema->pool = sp;
+    schema->id_col_nr = -1;
+    schema->name_col_nr = -1;
+    schema->status_col_nr = -1;
+    schema->host_col_nr = -1;
+    schema->subnodes_db_url_col_nr = -1;
+    schema->lastmodified_col_nr = -1;
+    schema->uuid_col_nr = -1;
 
     // This crashes with last argument 0 - i.e. only random access works
     int ret_val = apr_dbd_select(dbd->driver, p, dbd->handle, &res, query, 1);
     if(ret_val != 0){
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Query execution error in set_fields, %i.", ret_val);
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Query execution error in load_schema, %i.", ret_val);
         return NULL;
     }
 
-    int cols = apr_dbd_num_tuples(dbd->driver, res);
-
-    //char** fields = malloc(cols * sizeof(char*));
-    char** fields = (char**)apr_pcalloc(p, cols * sizeof(char*));
-
-    if(fields == NULL){
-      ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p,
-        "Out of memory while allocating %i columns.", cols);
-      return NULL;
-    }
-    for(i = 0; i < cols; i++){
-    //fields[i] = malloc(MAX_F_SIZE * sizeof(char));
-    fields[i] = (char*)apr_pcalloc(p, MAX_F_SIZE * sizeof(char*));
-      if(fields[i] == NULL){
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Out of memory.");
-        return NULL;
-      }
-    }
+    schema->cols = apr_dbd_num_tuples(dbd->driver, res);
+    schema->fields = (char**)apr_pcalloc(sp, schema->cols * sizeof(char*));
+    schema->descs = (column_desc*)apr_pcalloc(sp, schema->cols * sizeof(column_desc));
+    schema->table_num = table_num;
 
     /* Get the list of fields. */
-    i = 0;
-    while(i<cols){
+    while(i<schema->cols){
         row = NULL;
         // We have to use last argument 1, ... NOT -1. Only random access works.
         // Older libaprutil1 may start with 0 instead of 1...
@@ -525,272 +879,2117 @@ char** set_fields(apr_pool_t* p, ap_dbd_t* dbd, char* fields_str, char* query){
             return NULL;
         }
         val = (char*) apr_dbd_get_entry(dbd->driver, row, 0);
-        if(firstrow != 0){
+        schema->fields[i] = apr_pstrdup(sp, val);
+        init_column_desc(sp, &schema->descs[i], schema->fields[i], table_num);
+        /* The uuid column is only used for lookups and is not shown. */
+        if(apr_strnatcmp(val, UUID_COL) == 0){
+          schema->uuid_col_nr = i;
+          i++;
+          continue;
+        }
+        if(strlen(ret) > 0){
           ret = apr_pstrcat(p, ret, "\t", NULL);
         }
         ret = apr_pstrcat(p, ret, val, NULL);
-        apr_cpystrn(fields[i], val, strlen(val)+1);
-        //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "field --> %s", fields[i]);
         if(apr_strnatcmp(val, ID_COL) == 0){
-          id_col_nr = i;
+          schema->id_col_nr = i;
+          /* Key, the fourth column of SHOW fields: PRI, UNI, MUL or empty. */
+          key = apr_dbd_get_entry(dbd->driver, row, 3);
+          schema->id_unique = key != NULL && (strcmp(key, "PRI") == 0 || strcmp(key, "UNI") == 0);
         }
         if(apr_strnatcmp(val, NAME_COL) == 0){
-          name_col_nr = i;
+          schema->name_col_nr = i;
         }
         if(apr_strnatcmp(val, STATUS_COL) == 0){
-          status_col_nr = i;
+          schema->status_col_nr = i;
         }
         if(apr_strnatcmp(val, HOST_COL) == 0){
-          host_col_nr = i;
+          schema->host_col_nr = i;
         }
         if(apr_strnatcmp(val, SUBNODES_DB_URL_COL) == 0){
-          subnodes_db_url_col_nr = i;
+          schema->subnodes_db_url_col_nr = i;
+        }
+        if(apr_strnatcmp(val, LASTMODIFIED_COL) == 0){
+          schema->lastmodified_col_nr = i;
         }
-        firstrow = -1;
         i++;
         /* we can't break out here or row won't get cleaned up */
     }
     /* append the pseudo-column 'dbUrl' */
-    ret = apr_pstrcat(p, ret, "\t", NULL);
-    ret = apr_pstrcat(p, ret, DBURL_COL, NULL);
-
-    apr_cpystrn(fields_str, ret, strlen(ret)+1);
-
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Found fields: %s; first field: %s", fields_str, fields[0]);
+    schema->fields_str = apr_pstrcat(sp, ret, "\t", DBURL_COL, NULL);
+    schema->loaded = apr_time_now();
 
-    return fields;
+    return schema;
 }
 
-char* constructUUID(apr_pool_t* p, char* job_id){
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Constructing URL from %s", job_id);
-  char* uuid = memrchr(job_id, '/', strlen(job_id) - 1);
-  if(uuid != NULL){
-    uuid = uuid + 1;
+static void schema_cache_init(apr_pool_t* pchild, server_rec* s){
+  apr_status_t rv = apr_pool_create(&schemas.pool, pchild);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create schema cache pool.");
+    return;
   }
-  else{
-    uuid = job_id;
+  if(schemas.generation == NULL){
+    schemas.generation = &schemas.local_generation;
   }
-  return uuid;
+#if APR_HAS_THREADS
+  rv = apr_thread_mutex_create(&schemas.mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create schema cache mutex.");
+  }
+#endif
 }
 
-// From http://stackoverflow.com/questions/2674312/how-to-append-strings-using-sprintf
-int bytes_added( int result_of_sprintf ){
-    return (result_of_sprintf > 0) ? result_of_sprintf : 0;
+static void schema_lock(){
+#if APR_HAS_THREADS
+  if(schemas.mutex != NULL){
+    apr_thread_mutex_lock(schemas.mutex);
+  }
+#endif
 }
 
-char* recs_text_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t *res,
-   int priv, char* pub_fields_str, char* fields_str, char** fields){
-  apr_status_t rv;
-  char* val;
-  apr_dbd_row_t* row;
-  int i = 0;
-  char* uuid = "";
-  char* checkStr;
-  char* checkStart;
-  char* checkEnd;
-  int fieldLen;
-  char* recs = malloc(MAX_SIZE);
+static void schema_unlock(){
+#if APR_HAS_THREADS
+  if(schemas.mutex != NULL){
+    apr_thread_mutex_unlock(schemas.mutex);
+  }
+#endif
+}
+
+/* Request pool cleanup, dropping a reference taken by get_schema(). */
+static apr_status_t schema_release(void* data){
+  table_schema* schema = (table_schema*)data;
+  schema_lock();
+  if(--schema->refs == 0 && schema->retired){
+    apr_pool_destroy(schema->pool);
+  }
+  schema_unlock();
+  return APR_SUCCESS;
+}
 
-  int cols = apr_dbd_num_cols(dbd->driver,res);
-  // Works only for synchronous selects (1 instead of 0)
-  //int numrows = apr_dbd_num_tuples(dbd->driver,res);
+/**
+ * Get the schema of a table from the cache of this process, (re)loading it
+ * if it is missing, older than the configured TTL or a reload was requested.
+ * The table is read without holding the cache lock; meanwhile other threads
+ * keep using the old schema. The schema is referenced until the end of the
+ * request - also if it is replaced meanwhile, e.g. during a long listing on
+ * another thread.
+ */
+table_schema* get_schema(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, int table_num){
 
-  int pub_check[cols];
+  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
+  int ttl = conf->schema_ttl_ >= 0 ? conf->schema_ttl_ : DEFAULT_SCHEMA_TTL;
+  const char* query = schema_query(table_num);
+  table_schema* schema;
+  table_schema* loaded;
+  apr_pool_t* sp = NULL;
+  apr_uint32_t generation;
+
+  if(query == NULL || schemas.pool == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No schema for table %i.", table_num);
+    return NULL;
+  }
 
-  if(priv){
-    strcpy(recs, pub_fields_str);
+  generation = apr_atomic_read32(schemas.generation);
+  schema_lock();
+  schema = schemas.tables[table_num];
+  if(schema != NULL && (schemas.loading[table_num] || (schema->generation == generation &&
+     (ttl == 0 || r->request_time - schema->loaded < apr_time_from_sec(ttl))))){
+    ++schemas.hits;
   }
-  else{
-    strcpy(recs, fields_str);
+  /* The subpool is created and destroyed under the lock, as schemas.pool is shared. */
+  else if(apr_pool_create(&sp, schemas.pool) == APR_SUCCESS){
+    schemas.loading[table_num] = 1;
   }
-
-  int rownum = 0;
-  int length = strlen(recs);
-  //while(rownum <= numrows){
-  while(rownum<MAX_SELECT_ROWS){
-    row = NULL;
-    rv = apr_dbd_get_row(dbd->driver, p, res, &row, -1);
-    if(rv != 0){
-      break;
+  if(sp == NULL){
+    if(schema != NULL){
+      ++schema->refs;
+      apr_pool_cleanup_register(r->pool, schema, schema_release, apr_pool_cleanup_null);
     }
-    length += bytes_added(sprintf(recs+length, "%s", "\n"));
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "retrieved row %i, cols %i", rownum, cols);
-    for(i = 0 ; i < cols ; i++){
-      // To check if a field is a member of pub_fields, just see if pub_fields_str contains
-      // "\tfield\t".
-      if(rownum>0 && !pub_check[i]){
-        continue;
-      }
-      if(rownum==0){
-        checkStr = strstr(pub_fields_str, fields[i]);
-        fieldLen = strlen(fields[i]);
-        checkStart = checkStr-1;
-        checkEnd = checkStr+fieldLen;
-        //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Checking field %s", fields[i]);
-        if(priv && checkStr != pub_fields_str && (
-          checkStr == NULL ||
-          (checkStart != NULL && *checkStart != '\t') ||
-          (checkEnd != NULL && *checkEnd != '\t')
-          )){
-          pub_check[i] = 0;
-          continue;
-        }
-        pub_check[i] = 1;
-      }
-      val = (char*) apr_dbd_get_entry(dbd->driver, row, i);
-      //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "--> %s", val);
-      length += bytes_added(sprintf(recs+length, "%s", val));
-      length += bytes_added(sprintf(recs+length, "%s", "\t"));
-      if(i == id_col_nr){
-        uuid = constructUUID(p, val);
+    schema_unlock();
+    return schema;
+  }
+  schema_unlock();
+
+  loaded = load_schema(sp, p, dbd, query, table_num);
+
+  schema_lock();
+  schemas.loading[table_num] = 0;
+  if(loaded == NULL){
+    apr_pool_destroy(sp);
+  }
+  else{
+    loaded->generation = generation;
+    if(schemas.tables[table_num] != NULL){
+      schemas.tables[table_num]->retired = 1;
+      if(schemas.tables[table_num]->refs == 0){
+        apr_pool_destroy(schemas.tables[table_num]->pool);
       }
     }
-    length += bytes_added(sprintf(recs+length, "%s", base_url));
-    length += bytes_added(sprintf(recs+length, "%s", uuid));
-    /* we can't break out here or row won't get cleaned up */
-    rownum++;
+    schemas.tables[table_num] = loaded;
+    ++schemas.refreshes;
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Loaded schema of table %i: %s",
+      table_num, loaded->fields_str);
+    if(table_num == NODE_TABLE_NUM && !loaded->id_unique){
+      ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "nodeInformation.identifier is not a unique key; "
+        "node records are written with two statements under a lock. Add a unique index.");
+    }
   }
-  if(rownum>=MAX_SELECT_ROWS-1){
-    ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, "WARNING: max number of rows reached by recs_text_format.");
+  /* Keep serving the old schema, if any, if the table could not be read. */
+  schema = schemas.tables[table_num];
+  if(schema != NULL){
+    ++schema->refs;
+    apr_pool_cleanup_register(r->pool, schema, schema_release, apr_pool_cleanup_null);
   }
+  schema_unlock();
 
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Returning %i rows", rownum);
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%s", recs);
+  return schema;
+}
 
-  char* ret = (char*)apr_pcalloc(p, strlen(recs) * sizeof(char*));
-  apr_cpystrn(ret, recs, strlen(recs)+1);
-  free(recs);
-  return ret;
+char* constructUUID(apr_pool_t* p, char* job_id){
+  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Constructing URL from %s", job_id);
+  char* uuid = memrchr(job_id, '/', strlen(job_id) - 1);
+  if(uuid != NULL){
+    uuid = uuid + 1;
+  }
+  else{
+    uuid = job_id;
+  }
+  return uuid;
 }
 
-char* recs_xml_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t *res,
-   int priv, int table_num){
-  apr_status_t rv;
-  char* val;
-  apr_dbd_row_t* row;
-  int i = 0;
-  char* id = "";
-  char* recs = malloc(MAX_SIZE);
-  char* rec_name = (char*)apr_pcalloc(p, 8 * sizeof(char*));
-  char* list_name = (char*)apr_pcalloc(p, 8 * sizeof(char*));
+static int cmp_strings(const void* a, const void* b){
+  return strcmp(*(const char**)a, *(const char**)b);
+}
 
-  switch(table_num){
-    case JOB_TABLE_NUM:
-      sprintf(rec_name, "job");
-      sprintf(list_name, "jobs");
-      break;
-    case HIST_TABLE_NUM:
-      sprintf(rec_name, "job");
-      sprintf(list_name, "history");
-      break;
-    case NODE_TABLE_NUM:
-      sprintf(rec_name, "node");
-      sprintf(list_name, "nodes");
+/* The descriptor of the column of this name, or NULL if the table has none - or it is uuid. */
+static column_desc* schema_column(table_schema* schema, const char* name){
+  int i;
+  for(i = 0; i < schema->cols; ++i){
+    if(i != schema->uuid_col_nr && strcmp(schema->fields[i], name) == 0){
+      return &schema->descs[i];
+    }
+  }
+  return NULL;
+}
+
+/* Whether the table has a column of this name. */
+static int is_field(table_schema* schema, const char* name){
+  return schema_column(schema, name) != NULL;
+}
+
+/**
+ * Column projection
+ *
+ * Queries select only the columns that are returned instead of SELECT *: those asked
+ * for with ?fields=a,b,... - all by default - and of these, with privacy on, only the
+ * public ones. The hidden uuid column is never selected. Listings also select identifier
+ * and lastModified, needed for dbUrl and paging, without showing them unless asked for.
+ */
+typedef struct {
+  /* The select list, e.g. "`identifier`, `name`". */
+  char* select;
+  int cols;
+  /* The selected columns, in select order. */
+  const column_desc** descs;
+  /* Whether each selected column is returned. */
+  int* shown;
+  /* Tab separated returned columns, followed by the pseudo-column 'dbUrl'. */
+  char* fields_str;
+  int id_col_nr;
+  int name_col_nr;
+  int status_col_nr;
+  int host_col_nr;
+  int subnodes_db_url_col_nr;
+  int lastmodified_col_nr;
+} projection;
+
+static void projection_add(projection* pr, const column_desc* d, int shown){
+  int i;
+  for(i = 0; i < pr->cols; ++i){
+    if(pr->descs[i] == d){
+      pr->shown[i] |= shown;
+      return;
+    }
+  }
+  i = pr->cols++;
+  pr->descs[i] = d;
+  pr->shown[i] = shown;
+  if(d->role == ROLE_ID){
+    pr->id_col_nr = i;
+  }
+  else if(d->role == ROLE_NAME){
+    pr->name_col_nr = i;
+  }
+  else if(d->role == ROLE_STATUS){
+    pr->status_col_nr = i;
+  }
+  else if(d->role == ROLE_HOST){
+    pr->host_col_nr = i;
+  }
+  else if(d->role == ROLE_SUBNODES_DB_URL){
+    pr->subnodes_db_url_col_nr = i;
+  }
+  else if(d->role == ROLE_LASTMODIFIED){
+    pr->lastmodified_col_nr = i;
+  }
+}
+
+/**
+ * Project schema on the comma or tab separated fields of wanted - all columns if NULL or
+ * empty - keeping only the public ones if priv. With keys, identifier and lastModified
+ * are selected as well. Returns NULL if wanted has a field the table does not have.
+ */
+static projection* make_projection(apr_pool_t* p, table_schema* schema, const char* wanted,
+   int priv, int keys){
+  projection* pr = (projection*)apr_pcalloc(p, sizeof(projection));
+  const column_desc* d;
+  char* list;
+  char* field;
+  char* last;
+  int i;
+
+  pr->descs = (const column_desc**)apr_palloc(p, (schema->cols + 2) * sizeof(column_desc*));
+  pr->shown = (int*)apr_palloc(p, (schema->cols + 2) * sizeof(int));
+  pr->id_col_nr = pr->name_col_nr = pr->status_col_nr = pr->host_col_nr = -1;
+  pr->subnodes_db_url_col_nr = pr->lastmodified_col_nr = -1;
+
+  if(wanted != NULL && *wanted != '\0'){
+    list = apr_pstrdup(p, wanted);
+    for(field = apr_strtok(list, ",\t", &last); field != NULL; field = apr_strtok(NULL, ",\t", &last)){
+      if(strcmp(field, DBURL_COL) == 0){
+        continue;
+      }
+      if((d = schema_column(schema, field)) == NULL){
+        return NULL;
+      }
+      if(!priv || d->pub){
+        projection_add(pr, d, 1);
+      }
+    }
+  }
+  /* In the order of the public fields if private, otherwise of the table. */
+  else if(priv){
+    list = apr_pstrdup(p, schema->table_num == NODE_TABLE_NUM ? NODE_PUB_FIELDS_STR : JOB_PUB_FIELDS_STR);
+    for(field = apr_strtok(list, "\t", &last); field != NULL; field = apr_strtok(NULL, "\t", &last)){
+      if((d = schema_column(schema, field)) != NULL){
+        projection_add(pr, d, 1);
+      }
+    }
+  }
+  else{
+    for(i = 0; i < schema->cols; ++i){
+      if(i != schema->uuid_col_nr){
+        projection_add(pr, &schema->descs[i], 1);
+      }
+    }
+  }
+  if(keys && schema->id_col_nr >= 0){
+    projection_add(pr, &schema->descs[schema->id_col_nr], 0);
+  }
+  if(keys && schema->lastmodified_col_nr >= 0){
+    projection_add(pr, &schema->descs[schema->lastmodified_col_nr], 0);
+  }
+
+  pr->select = "";
+  pr->fields_str = "";
+  for(i = 0; i < pr->cols; ++i){
+    pr->select = apr_pstrcat(p, pr->select, i > 0 ? ", `" : "`", pr->descs[i]->name, "`", NULL);
+    if(pr->shown[i]){
+      pr->fields_str = apr_pstrcat(p, pr->fields_str, pr->descs[i]->name, "\t", NULL);
+    }
+  }
+  if(pr->cols == 0){
+    return NULL;
+  }
+  pr->fields_str = apr_pstrcat(p, pr->fields_str, DBURL_COL, NULL);
+  return pr;
+}
+
+/**
+ * Statement cache
+ *
+ * Queries are built with %s placeholders for all values coming from requests, never
+ * with the values themselves; the values are passed in an array next to the query.
+ * With PrepareStatements On, each distinct query text - i.e. each shape of table, columns
+ * and operators - is prepared once per database connection and kept in a per-connection
+ * LRU of at most STMT_CACHE_SIZE statements. Otherwise - PrepareStatements is Off by
+ * default - or if preparing fails, the values are escaped and quoted into the query text
+ * instead, and the LRU is not used.
+ */
+
+#define STMT_CACHE_SIZE 64
+
+typedef struct stmt_entry {
+  const char* sql;
+  /* Destroying this pool closes the statement. */
+  apr_pool_t* pool;
+  apr_dbd_prepared_t* statement;
+  struct stmt_entry* prev;
+  struct stmt_entry* next;
+} stmt_entry;
+
+typedef struct {
+  apr_hash_t* entries;
+  /* Most recently used first. */
+  stmt_entry* head;
+  stmt_entry* tail;
+  int count;
+} stmt_cache;
+
+/* Counters of the statement caches of this process. */
+static volatile apr_uint32_t stmt_hits = 0;
+static volatile apr_uint32_t stmt_misses = 0;
+static volatile apr_uint32_t stmt_evictions = 0;
+
+static void stmt_unlink(stmt_cache* cache, stmt_entry* e){
+  if(e->prev != NULL){
+    e->prev->next = e->next;
+  }
+  else{
+    cache->head = e->next;
+  }
+  if(e->next != NULL){
+    e->next->prev = e->prev;
+  }
+  else{
+    cache->tail = e->prev;
+  }
+  e->prev = e->next = NULL;
+}
+
+static void stmt_push(stmt_cache* cache, stmt_entry* e){
+  e->prev = NULL;
+  e->next = cache->head;
+  if(cache->head != NULL){
+    cache->head->prev = e;
+  }
+  cache->head = e;
+  if(cache->tail == NULL){
+    cache->tail = e;
+  }
+}
+
+/**
+ * Get the statement for sql prepared on this connection, preparing it on first use.
+ * Returns NULL if it cannot be prepared.
+ */
+static apr_dbd_prepared_t* stmt_get(ap_dbd_t* dbd, const char* sql){
+  stmt_cache* cache = NULL;
+  stmt_entry* e;
+  apr_pool_t* ep;
+
+  apr_pool_userdata_get((void**)&cache, STMT_CACHE_KEY, dbd->pool);
+  if(cache == NULL){
+    cache = (stmt_cache*)apr_pcalloc(dbd->pool, sizeof(stmt_cache));
+    cache->entries = apr_hash_make(dbd->pool);
+    apr_pool_userdata_setn(cache, STMT_CACHE_KEY, NULL, dbd->pool);
+  }
+  e = (stmt_entry*)apr_hash_get(cache->entries, sql, APR_HASH_KEY_STRING);
+  if(e != NULL){
+    apr_atomic_inc32(&stmt_hits);
+    if(e != cache->head){
+      stmt_unlink(cache, e);
+      stmt_push(cache, e);
+    }
+    return e->statement;
+  }
+  apr_atomic_inc32(&stmt_misses);
+  if(cache->count >= STMT_CACHE_SIZE){
+    e = cache->tail;
+    stmt_unlink(cache, e);
+    apr_hash_set(cache->entries, e->sql, APR_HASH_KEY_STRING, NULL);
+    apr_pool_destroy(e->pool);
+    --cache->count;
+    apr_atomic_inc32(&stmt_evictions);
+  }
+  if(apr_pool_create(&ep, dbd->pool) != APR_SUCCESS){
+    return NULL;
+  }
+  e = (stmt_entry*)apr_pcalloc(ep, sizeof(stmt_entry));
+  e->pool = ep;
+  e->sql = apr_pstrdup(ep, sql);
+  if(apr_dbd_prepare(dbd->driver, ep, dbd->handle, e->sql, NULL, &e->statement) != 0){
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, dbd->pool, "Failed to prepare %s: %s", sql,
+      apr_dbd_error(dbd->driver, dbd->handle, 0));
+    apr_pool_destroy(ep);
+    return NULL;
+  }
+  stmt_push(cache, e);
+  apr_hash_set(cache->entries, e->sql, APR_HASH_KEY_STRING, e);
+  ++cache->count;
+  return e->statement;
+}
+
+/* sql with each %s replaced by the next of args, escaped and quoted, and %% by %. */
+static char* stmt_literal(apr_pool_t* p, ap_dbd_t* dbd, const char* sql, apr_array_header_t* args){
+  char* ret = "";
+  const char* run = sql;
+  const char* c;
+  const char* val;
+  int n = 0;
+  for(c = sql; *c != '\0'; ++c){
+    if(*c != '%' || (c[1] != 's' && c[1] != '%')){
+      continue;
+    }
+    ret = apr_pstrcat(p, ret, apr_pstrndup(p, run, c - run), NULL);
+    if(c[1] == '%'){
+      ret = apr_pstrcat(p, ret, "%", NULL);
+    }
+    else{
+      val = n < args->nelts ? APR_ARRAY_IDX(args, n, const char*) : NULL;
+      ++n;
+      ret = val == NULL ? apr_pstrcat(p, ret, "NULL", NULL) :
+         apr_pstrcat(p, ret, "'", apr_dbd_escape(dbd->driver, p, val, dbd->handle), "'", NULL);
+    }
+    run = ++c + 1;
+  }
+  return apr_pstrcat(p, ret, run, NULL);
+}
+
+static int use_prepared(request_rec* r){
+  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
+  return conf->ps_ != NULL && apr_strnatcasecmp(conf->ps_, "On") == 0;
+}
+
+/* Run the SELECT sql with the values args. Returns 0 on success. */
+static int stmt_select(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t** res,
+   const char* sql, apr_array_header_t* args, int random){
+  apr_dbd_prepared_t* statement;
+  int rv;
+  if(use_prepared(r) && (statement = stmt_get(dbd, sql)) != NULL){
+    rv = apr_dbd_pselect(dbd->driver, p, dbd->handle, res, statement, random,
+       args->nelts, (const char**)args->elts);
+  }
+  else{
+    rv = apr_dbd_select(dbd->driver, p, dbd->handle, res, stmt_literal(p, dbd, sql, args), random);
+  }
+  if(rv != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Query execution error for %s: %s", sql,
+       apr_dbd_error(dbd->driver, dbd->handle, rv));
+  }
+  return rv;
+}
+
+/**
+ * Run the SELECT sql with the values args for its first row: *row is that row, or NULL
+ * if there is none. The result is buffered, so the row stays valid - and is fetched
+ * as row 1: apr_dbd_get_row() fails for row number -1 on buffered results.
+ * Returns 0 on success.
+ */
+static int stmt_select_row(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t** res,
+   apr_dbd_row_t** row, const char* sql, apr_array_header_t* args){
+  *row = NULL;
+  if(stmt_select(r, p, dbd, res, sql, args, 1) != 0){
+    return -1;
+  }
+  if(apr_dbd_get_row(dbd->driver, p, *res, row, 1) != 0){
+    *row = NULL;
+  }
+  return 0;
+}
+
+/* Run the statement sql with the values args. Returns 0 on success. */
+static int stmt_query(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, int* nrows,
+   const char* sql, apr_array_header_t* args){
+  apr_dbd_prepared_t* statement;
+  int rv;
+  if(use_prepared(r) && (statement = stmt_get(dbd, sql)) != NULL){
+    rv = apr_dbd_pquery(dbd->driver, p, dbd->handle, nrows, statement,
+       args->nelts, (const char**)args->elts);
+  }
+  else{
+    rv = apr_dbd_query(dbd->driver, dbd->handle, nrows, stmt_literal(p, dbd, sql, args));
+  }
+  if(rv != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Query execution error for %s: %s", sql,
+       apr_dbd_error(dbd->driver, dbd->handle, rv));
+  }
+  return rv;
+}
+
+/**
+ * Push the values vals onto args, padded to a power of two by repeating the last one,
+ * and return item - e.g. "%s" - once per pushed value, separated by sep. vals must not
+ * be empty. The padding keeps the number of statements prepared for lists small.
+ */
+static const char* stmt_list(apr_pool_t* p, apr_array_header_t* args, apr_array_header_t* vals,
+   const char* item, const char* sep){
+  str_buf b;
+  int n = 1;
+  int i;
+  while(n < vals->nelts){
+    n *= 2;
+  }
+  buf_init(&b, p);
+  for(i = 0; i < n; ++i){
+    APR_ARRAY_PUSH(args, const char*) = APR_ARRAY_IDX(vals, i < vals->nelts ? i : vals->nelts - 1,
+       const char*);
+    buf_cat(&b, i > 0 ? sep : "", item, NULL);
+  }
+  return b.data;
+}
+
+/* Escape the wildcards of LIKE. */
+static char* like_escape(apr_pool_t* p, const char* val){
+  char* ret = (char*)apr_palloc(p, 2 * strlen(val) + 1);
+  char* c = ret;
+  for(; *val != '\0'; ++val){
+    if(*val == '%' || *val == '_' || *val == '\\'){
+      *c++ = '\\';
+    }
+    *c++ = *val;
+  }
+  *c = '\0';
+  return ret;
+}
+
+/**
+ * The WHERE clause finding the record uuid - by the uuid column if the table has it -
+ * with its value pushed onto args.
+ */
+static const char* rec_where(apr_pool_t* p, table_schema* schema, int table_num, const char* uuid,
+   apr_array_header_t* args){
+  if(table_num == NODE_TABLE_NUM){
+    APR_ARRAY_PUSH(args, const char*) = uuid;
+    return ID_WHERE;
+  }
+  if(schema->uuid_col_nr >= 0){
+    APR_ARRAY_PUSH(args, const char*) = uuid;
+    return UUID_WHERE;
+  }
+  /* Job identifiers are URLs ending with the UUID. */
+  APR_ARRAY_PUSH(args, const char*) = apr_pstrcat(p, "%/", like_escape(p, uuid), NULL);
+  return ID_LIKE_WHERE;
+}
+
+/**
+ * Streaming output
+ *
+ * List responses are written into a brigade as the rows come off the
+ * database and passed down the output filters every OUT_CHUNK_SIZE bytes,
+ * so memory use per request does not grow with the number of rows.
+ * Listings are gzip compressed on the way, when the client accepts it.
+ *
+ * Small writes - markup and most cell values - are coalesced into heap
+ * buckets. Anything of at least APR_BUCKET_BUFF_SIZE bytes is not copied:
+ * it is added as a transient bucket and passed on right away, together
+ * with what is buffered before it, while the database row (or deflate
+ * buffer) it points into is still valid.
+ */
+
+/* Number of buffered bytes at which the output brigade is passed on. */
+static apr_size_t OUT_CHUNK_SIZE = 65536;
+
+/* Size of the buffer deflate() writes compressed output to. A full buffer
+ * is passed on without copying, so this is also the compressed chunk size. */
+#define OUT_ZBUF_SIZE 65536
+
+struct out_stream {
+  request_rec* r;
+  apr_bucket_brigade* bb;
+  apr_size_t buffered;
+  apr_status_t rv;
+  /* When not NULL, a copy of everything written, for the response cache.
+   * Dropped once more than capture_max bytes are written. */
+  char* capture;
+  apr_size_t captured;
+  apr_size_t capture_max;
+  /* When not NULL, the output is gzip compressed into zbuf as it is written. */
+  z_stream* z;
+  char* zbuf;
+};
+
+static void out_init(out_stream* out, request_rec* r, apr_pool_t* p){
+  out->r = r;
+  out->bb = apr_brigade_create(p, r->connection->bucket_alloc);
+  out->buffered = 0;
+  out->rv = APR_SUCCESS;
+  out->capture = NULL;
+  out->captured = 0;
+  out->capture_max = 0;
+  out->z = NULL;
+  out->zbuf = NULL;
+}
+
+/* Keep a copy of up to max bytes of the output. */
+static void out_capture(out_stream* out, apr_pool_t* p, apr_size_t max){
+  out->capture = (char*)apr_palloc(p, max);
+  out->captured = 0;
+  out->capture_max = max;
+}
+
+/* Pass whatever is buffered on to the output filters. */
+static apr_status_t out_flush(out_stream* out){
+  if(APR_BRIGADE_EMPTY(out->bb) || out->rv != APR_SUCCESS){
+    return out->rv;
+  }
+  out->rv = ap_pass_brigade(out->r->output_filters, out->bb);
+  apr_brigade_cleanup(out->bb);
+  out->buffered = 0;
+  if(out->rv != APR_SUCCESS){
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, out->rv, out->r, "Failed to write response.");
+  }
+  return out->rv;
+}
+
+/* Add bytes as they go on the wire to the brigade - and the capture. */
+static void out_emit(out_stream* out, const char* data, apr_size_t len){
+  if(out->rv != APR_SUCCESS || len == 0){
+    return;
+  }
+  if(out->capture != NULL){
+    if(out->captured + len > out->capture_max){
+      out->capture = NULL;
+    }
+    else{
+      memcpy(out->capture + out->captured, data, len);
+      out->captured += len;
+    }
+  }
+  if(len >= APR_BUCKET_BUFF_SIZE){
+    APR_BRIGADE_INSERT_TAIL(out->bb, apr_bucket_transient_create(data, len,
+       out->bb->bucket_alloc));
+    out_flush(out);
+    return;
+  }
+  out->rv = apr_brigade_write(out->bb, NULL, NULL, data, len);
+  out->buffered += len;
+  if(out->buffered >= OUT_CHUNK_SIZE){
+    out_flush(out);
+  }
+}
+
+/* Compress len bytes of data, emitting whatever deflate() produces. */
+static void out_deflate(out_stream* out, const char* data, apr_size_t len, int flush){
+  out->z->next_in = (Bytef*)data;
+  out->z->avail_in = len;
+  do{
+    out->z->next_out = (Bytef*)out->zbuf;
+    out->z->avail_out = OUT_ZBUF_SIZE;
+    if(deflate(out->z, flush) == Z_STREAM_ERROR){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, out->r, "Failed to compress response.");
+      out->rv = APR_EGENERAL;
+      return;
+    }
+    out_emit(out, out->zbuf, OUT_ZBUF_SIZE - out->z->avail_out);
+  } while(out->z->avail_out == 0 && out->rv == APR_SUCCESS);
+}
+
+static apr_status_t out_zcleanup(void* data){
+  out_stream* out = (out_stream*)data;
+  if(out->z != NULL){
+    deflateEnd(out->z);
+    out->z = NULL;
+  }
+  return APR_SUCCESS;
+}
+
+/**
+ * Gzip compress everything written from now on and say so in Content-Encoding.
+ * mod_deflate leaves responses with a Content-Encoding alone.
+ */
+static void out_gzip(out_stream* out, apr_pool_t* p){
+  out->z = (z_stream*)apr_pcalloc(p, sizeof(z_stream));
+  /* 16 + MAX_WBITS: a gzip header and trailer instead of a zlib one. */
+  if(deflateInit2(out->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+     Z_DEFAULT_STRATEGY) != Z_OK){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, out->r, "Failed to initialize compression.");
+    out->z = NULL;
+    return;
+  }
+  out->zbuf = (char*)apr_palloc(p, OUT_ZBUF_SIZE);
+  apr_pool_cleanup_register(p, out, out_zcleanup, apr_pool_cleanup_null);
+  apr_table_setn(out->r->headers_out, "Content-Encoding", "gzip");
+}
+
+static void out_write(out_stream* out, const char* data, apr_size_t len){
+  if(out->rv != APR_SUCCESS || len == 0){
+    return;
+  }
+  if(out->z != NULL){
+    out_deflate(out, data, len, Z_NO_FLUSH);
+  }
+  else{
+    out_emit(out, data, len);
+  }
+}
+
+/* End the response: finish the compressed stream, if any, and pass on the rest. */
+static apr_status_t out_finish(out_stream* out){
+  if(out->z != NULL){
+    out_deflate(out, NULL, 0, Z_FINISH);
+    out_zcleanup(out);
+  }
+  return out_flush(out);
+}
+
+/**
+ * Whether Accept-Encoding allows gzip, i.e. lists gzip or x-gzip without q=0.
+ */
+static int accepts_gzip(request_rec* r){
+  const char* accept = apr_table_get(r->headers_in, "Accept-Encoding");
+  const char* c = accept;
+  const char* name;
+  apr_size_t len;
+  const char* q;
+  if(accept == NULL){
+    return 0;
+  }
+  while(*c != '\0'){
+    while(*c == ' ' || *c == ','){
+      ++c;
+    }
+    name = c;
+    while(*c != '\0' && *c != ',' && *c != ';' && *c != ' '){
+      ++c;
+    }
+    len = c - name;
+    q = NULL;
+    while(*c != '\0' && *c != ','){
+      if(*c == 'q' && c[1] == '='){
+        q = c + 2;
+      }
+      ++c;
+    }
+    if((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0)){
+      return q == NULL || atof(q) > 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Keyset pagination
+ *
+ * A paged listing is ordered by (lastModified, identifier) and each page
+ * starts after the key of the last row of the previous one, so MySQL never
+ * has to read and discard the rows of earlier pages. The key is handed to
+ * the client as an opaque, URL-safe base64 token.
+ */
+
+typedef struct {
+  /* Page size; 0 when the listing is not paged. */
+  int size;
+  /* Index of the lastModified and identifier columns in the result. */
+  int lastmodified_col_nr;
+  int id_col_nr;
+  /* Key of the last row written. */
+  char* last_modified;
+  apr_size_t last_modified_size;
+  char* identifier;
+  apr_size_t identifier_size;
+} list_page;
+
+/* Copy val into *buf, growing it if needed. */
+static void page_remember(apr_pool_t* p, char** buf, apr_size_t* size, const char* val){
+  apr_size_t len = val == NULL ? 0 : strlen(val);
+  if(len + 1 > *size){
+    *size = 2 * (len + 1);
+    *buf = apr_palloc(p, *size);
+  }
+  memcpy(*buf, val == NULL ? "" : val, len);
+  (*buf)[len] = '\0';
+}
+
+static void page_remember_row(apr_pool_t* p, list_page* page, ap_dbd_t* dbd, apr_dbd_row_t* row){
+  if(page == NULL || page->size <= 0){
+    return;
+  }
+  page_remember(p, &page->last_modified, &page->last_modified_size,
+    apr_dbd_get_entry(dbd->driver, row, page->lastmodified_col_nr));
+  page_remember(p, &page->identifier, &page->identifier_size,
+    apr_dbd_get_entry(dbd->driver, row, page->id_col_nr));
+}
+
+/* Encode lastModified and identifier as a cursor token. */
+static char* make_page_token(apr_pool_t* p, const char* last_modified, const char* identifier){
+  char* key = apr_pstrcat(p, last_modified, "\t", identifier, NULL);
+  char* token = apr_palloc(p, apr_base64_encode_len(strlen(key)));
+  char* c;
+  apr_base64_encode(token, key, strlen(key));
+  /* Make it URL safe. */
+  for(c = token; *c; ++c){
+    if(*c == '+'){
+      *c = '-';
+    }
+    else if(*c == '/'){
+      *c = '_';
+    }
+    else if(*c == '='){
+      *c = '\0';
       break;
-    default:
-      ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Invalid path: %i", table_num);
+    }
+  }
+  return token;
+}
+
+/* Decode a cursor token. Returns 0 on success. */
+static int parse_page_token(apr_pool_t* p, const char* token, char** last_modified, char** identifier){
+  apr_size_t len = strlen(token);
+  char* padded = apr_palloc(p, len + 4);
+  char* key;
+  char* tab;
+  apr_size_t i;
+  for(i = 0; i < len; ++i){
+    if(token[i] == '-'){
+      padded[i] = '+';
+    }
+    else if(token[i] == '_'){
+      padded[i] = '/';
+    }
+    else if(isalnum((unsigned char)token[i])){
+      padded[i] = token[i];
+    }
+    else{
+      return -1;
+    }
+  }
+  while(i % 4 != 0){
+    padded[i++] = '=';
   }
+  padded[i] = '\0';
+  key = apr_palloc(p, apr_base64_decode_len(padded) + 1);
+  key[apr_base64_decode(key, padded)] = '\0';
+  tab = strchr(key, '\t');
+  if(tab == NULL){
+    return -1;
+  }
+  *tab = '\0';
+  *last_modified = key;
+  *identifier = tab + 1;
+  return 0;
+}
+
+static void set_format_content_type(request_rec* r, int format){
+  if(format == XML_FORMAT){
+    ap_set_content_type(r, "text/xml;charset=ascii");
+  }
+  else if(format == JSON_FORMAT){
+    ap_set_content_type(r, JSON_CONTENT_TYPE);
+  }
+  else{
+    ap_set_content_type(r, "text/plain;charset=ascii");
+  }
+}
+
+/* Stream tab separated lines, the first of which is the list of fields. */
+int recs_text_format(apr_pool_t* p, out_stream* out, ap_dbd_t* dbd, apr_dbd_results_t *res,
+   projection* pr, list_page* page){
+  apr_status_t rv;
+  char* val;
+  apr_dbd_row_t* row;
+  int i = 0;
+  char* uuid = "";
+  apr_pool_t* rowp;
+
+  /* Each row is fetched into rowp, which is cleared for the next one. */
+  if(apr_pool_create(&rowp, p) != APR_SUCCESS){
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Failed to create row pool.");
+    return -1;
+  }
+
+  out_puts(out, pr->fields_str);
 
-  strcpy(recs, "<?xml version=\"1.0\"?>\n<?xml-stylesheet type=\"text/xsl\" href=\"");
-  int length = strlen(recs);
-  length += bytes_added(sprintf(recs+length, "%s", xsl_dir));
-  length += bytes_added(sprintf(recs+length, "%s", list_name));
-  length += bytes_added(sprintf(recs+length, "%s", ".xsl\"?>\n<"));
-  length += bytes_added(sprintf(recs+length, "%s", list_name));
-  length += bytes_added(sprintf(recs+length, "%s", ">"));
-  //int numrows = apr_dbd_num_tuples(dbd->driver,res);
-  int cols = apr_dbd_num_cols(dbd->driver,res);
   int rownum = 0;
   while(rownum<MAX_SELECT_ROWS){
     row = NULL;
-    rv = apr_dbd_get_row(dbd->driver, p, res, &row, -1);
-    if (rv != 0) {
+    apr_pool_clear(rowp);
+    rv = apr_dbd_get_row(dbd->driver, rowp, res, &row, -1);
+    if(rv != 0){
       break;
     }
-    length += bytes_added(sprintf(recs+length, "%s", "\n  <"));
-    length += bytes_added(sprintf(recs+length, "%s", rec_name));
-    length += bytes_added(sprintf(recs+length, "%s", ">"));
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "cols: %i, %i, %i", status_col_nr, host_col_nr, subnodes_db_url_col_nr);
-    for (i = 0 ; i < cols ; i++) {
+    uuid = "";
+    out_puts(out, "\n");
+    for(i = 0 ; i < pr->cols ; i++){
       val = (char*) apr_dbd_get_entry(dbd->driver, row, i);
-      //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%i/%i --> %s", table_num, i, val);
-      if(val == NULL){
+      if(i == pr->id_col_nr){
+        uuid = constructUUID(rowp, val);
+      }
+      if(!pr->shown[i]){
         continue;
       }
-      if(i == id_col_nr){
-        id = val;
-        length += bytes_added(sprintf(recs+length, "%s", "\n    <"));
-        length += bytes_added(sprintf(recs+length, "%s", ID_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-        length += bytes_added(sprintf(recs+length, "%s", val));
-        length += bytes_added(sprintf(recs+length, "%s", "</"));
-        length += bytes_added(sprintf(recs+length, "%s", ID_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-      }
-      else if((table_num == JOB_TABLE_NUM || table_num == HIST_TABLE_NUM)  && i == name_col_nr){
-        length += bytes_added(sprintf(recs+length, "%s", "\n    <"));
-        length += bytes_added(sprintf(recs+length, "%s", NAME_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-        length += bytes_added(sprintf(recs+length, "%s", val));
-        length += bytes_added(sprintf(recs+length, "%s", "</"));
-        length += bytes_added(sprintf(recs+length, "%s", NAME_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-      }
-      else if((table_num == JOB_TABLE_NUM || table_num == HIST_TABLE_NUM)  && i == status_col_nr){
-        length += bytes_added(sprintf(recs+length, "%s", "\n    <"));
-        length += bytes_added(sprintf(recs+length, "%s", STATUS_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-        length += bytes_added(sprintf(recs+length, "%s", val));
-        length += bytes_added(sprintf(recs+length, "%s", "</"));
-        length += bytes_added(sprintf(recs+length, "%s", STATUS_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-      }
-      else if(table_num == NODE_TABLE_NUM && i == host_col_nr){
-        length += bytes_added(sprintf(recs+length, "%s", "\n    <"));
-        length += bytes_added(sprintf(recs+length, "%s", HOST_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-        length += bytes_added(sprintf(recs+length, "%s", val));
-        length += bytes_added(sprintf(recs+length, "%s", "</"));
-        length += bytes_added(sprintf(recs+length, "%s", HOST_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-      }
-      else if(table_num == NODE_TABLE_NUM && i == subnodes_db_url_col_nr){
-        length += bytes_added(sprintf(recs+length, "%s", "\n    <"));
-        length += bytes_added(sprintf(recs+length, "%s", SUBNODES_DB_URL_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-        length += bytes_added(sprintf(recs+length, "%s", val));
-        length += bytes_added(sprintf(recs+length, "%s", "</"));
-        length += bytes_added(sprintf(recs+length, "%s", SUBNODES_DB_URL_COL));
-        length += bytes_added(sprintf(recs+length, "%s", ">"));
-      }
-    }
-    length += bytes_added(sprintf(recs+length, "%s", "\n    <"));
-    length += bytes_added(sprintf(recs+length, "%s", DBURL_COL));
-    length += bytes_added(sprintf(recs+length, "%s",  ">"));
-    length += bytes_added(sprintf(recs+length, "%s", base_url));
-    length += bytes_added(sprintf(recs+length, "%s", constructUUID(p, id)));
-    length += bytes_added(sprintf(recs+length, "%s", "</"));
-    length += bytes_added(sprintf(recs+length, "%s", DBURL_COL));
-    length += bytes_added(sprintf(recs+length, "%s", ">"));
-    length += bytes_added(sprintf(recs+length, "%s", "\n  </"));
-    length += bytes_added(sprintf(recs+length, "%s", rec_name));
-    length += bytes_added(sprintf(recs+length, "%s", "> "));
+      out_puts(out, val);
+      out_puts(out, "\t");
+    }
+    out_puts(out, get_ctx(out->r)->base_url);
+    out_puts(out, uuid);
+    page_remember_row(p, page, dbd, row);
+    /* we can't break out here or row won't get cleaned up */
     rownum++;
   }
   if(rownum>=MAX_SELECT_ROWS-1){
-   ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, "WARNING: max number of rows reached by recs_xml_format.");
+    ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, "WARNING: max number of rows reached by recs_text_format.");
+  }
+  apr_pool_destroy(rowp);
+  /* A full page may be followed by more rows. */
+  if(page != NULL && page->size > 0 && rownum == page->size){
+    out_puts(out, "\n#");
+    out_puts(out, NEXT_PAGE_STR);
+    out_puts(out, "\t");
+    out_puts(out, make_page_token(p, page->last_modified, page->identifier));
   }
-  length += bytes_added(sprintf(recs+length, "%s", "\n</"));
-  length += bytes_added(sprintf(recs+length, "%s", list_name));
-  length += bytes_added(sprintf(recs+length, "%s", "> "));
 
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Returning rows");
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%s", recs);
+  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Returned %i rows", rownum);
 
-  char* ret = (char*)apr_pcalloc(p, strlen(recs) * sizeof(char*));
-  apr_cpystrn(ret, recs, strlen(recs)+1);
-  free(recs);
-  return ret;
+  return out_finish(out) == APR_SUCCESS ? rownum : -1;
+}
+
+/**
+ * Stream a JSON object with the list of DB records, e.g. {"jobs":[{...},...]}. Each record
+ * has the same fields as with text, followed by dbUrl.
+ */
+int recs_json_format(apr_pool_t* p, out_stream* out, ap_dbd_t* dbd, apr_dbd_results_t *res,
+   projection* pr, int table_num, list_page* page){
+  apr_status_t rv;
+  apr_dbd_row_t* row;
+  const char* val;
+  char* uuid;
+  int i;
+  int first;
+  apr_pool_t* rowp;
+
+  if(apr_pool_create(&rowp, p) != APR_SUCCESS){
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Failed to create row pool.");
+    return -1;
+  }
+
+  out_puts(out, "{");
+  out_json_str(out, TABLE_LIST_NAMES[table_num], strlen(TABLE_LIST_NAMES[table_num]));
+  out_puts(out, ":[");
+  int rownum = 0;
+  while(rownum<MAX_SELECT_ROWS){
+    row = NULL;
+    apr_pool_clear(rowp);
+    rv = apr_dbd_get_row(dbd->driver, rowp, res, &row, -1);
+    if(rv != 0){
+      break;
+    }
+    uuid = "";
+    out_puts(out, rownum == 0 ? "\n{" : ",\n{");
+    first = 1;
+    for(i = 0; i < pr->cols; i++){
+      val = apr_dbd_get_entry(dbd->driver, row, i);
+      if(i == pr->id_col_nr && val != NULL){
+        uuid = constructUUID(rowp, (char*)val);
+      }
+      if(!pr->shown[i]){
+        continue;
+      }
+      out_json_cell(out, first, pr->descs[i], val);
+      first = 0;
+    }
+    out_json_field(out, first, DBURL_COL, apr_pstrcat(rowp, get_ctx(out->r)->base_url, uuid, NULL));
+    out_puts(out, "}");
+    page_remember_row(p, page, dbd, row);
+    rownum++;
+  }
+  if(rownum>=MAX_SELECT_ROWS-1){
+    ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, "WARNING: max number of rows reached by recs_json_format.");
+  }
+  apr_pool_destroy(rowp);
+  out_puts(out, "\n]");
+  /* A full page may be followed by more rows. */
+  if(page != NULL && page->size > 0 && rownum == page->size){
+    out_json_field(out, 0, NEXT_PAGE_STR, make_page_token(p, page->last_modified, page->identifier));
+  }
+  out_puts(out, "}");
+
+  return out_finish(out) == APR_SUCCESS ? rownum : -1;
+}
+
+/**
+ * Stream an XML list of DB records. Only the main fields of each record are included;
+ * see JOB_XML_FIELDS_STR and NODE_XML_FIELDS_STR.
+ */
+int recs_xml_format(apr_pool_t* p, out_stream* out, ap_dbd_t* dbd, apr_dbd_results_t *res,
+   projection* pr, int table_num, list_page* page){
+  apr_status_t rv;
+  char* val;
+  apr_dbd_row_t* row;
+  int i = 0;
+  char* id = "";
+  char* rec_name = "";
+  char* list_name = "";
+  apr_pool_t* rowp;
+
+  switch(table_num){
+    case JOB_TABLE_NUM:
+      rec_name = "job";
+      list_name = "jobs";
+      break;
+    case HIST_TABLE_NUM:
+      rec_name = "job";
+      list_name = "history";
+      break;
+    case NODE_TABLE_NUM:
+      rec_name = "node";
+      list_name = "nodes";
+      break;
+    default:
+      ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Invalid path: %i", table_num);
+  }
+
+  if(apr_pool_create(&rowp, p) != APR_SUCCESS){
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Failed to create row pool.");
+    return -1;
+  }
+
+  out_puts(out, "<?xml version=\"1.0\"?>\n<?xml-stylesheet type=\"text/xsl\" href=\"");
+  out_puts(out, get_ctx(out->r)->xsl_dir);
+  out_puts(out, list_name);
+  out_puts(out, ".xsl\"?>\n<");
+  out_puts(out, list_name);
+  out_puts(out, ">");
+  int rownum = 0;
+  while(rownum<MAX_SELECT_ROWS){
+    row = NULL;
+    apr_pool_clear(rowp);
+    rv = apr_dbd_get_row(dbd->driver, rowp, res, &row, -1);
+    if (rv != 0) {
+      break;
+    }
+    id = "";
+    out_puts(out, "\n  <");
+    out_puts(out, rec_name);
+    out_puts(out, ">");
+    for (i = 0 ; i < pr->cols ; i++) {
+      val = (char*) apr_dbd_get_entry(dbd->driver, row, i);
+      //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%i/%i --> %s", table_num, i, val);
+      if(val == NULL){
+        continue;
+      }
+      if(i == pr->id_col_nr){
+        id = val;
+      }
+      if(!pr->shown[i]){
+        continue;
+      }
+      out_xml_cell(out, "\n    ", pr->descs[i], val);
+    }
+    out_puts(out, "\n    <");
+    out_puts(out, DBURL_COL);
+    out_puts(out, ">");
+    out_xml_puts(out, get_ctx(out->r)->base_url);
+    out_xml_puts(out, constructUUID(p, id));
+    out_puts(out, "</");
+    out_puts(out, DBURL_COL);
+    out_puts(out, ">");
+    out_puts(out, "\n  </");
+    out_puts(out, rec_name);
+    out_puts(out, "> ");
+    page_remember_row(p, page, dbd, row);
+    rownum++;
+  }
+  if(rownum>=MAX_SELECT_ROWS-1){
+   ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, "WARNING: max number of rows reached by recs_xml_format.");
+  }
+  apr_pool_destroy(rowp);
+  /* A full page may be followed by more rows. */
+  if(page != NULL && page->size > 0 && rownum == page->size){
+    out_xml_elem(out, "\n  ", NEXT_PAGE_STR, make_page_token(p, page->last_modified, page->identifier));
+  }
+  out_puts(out, "\n</");
+  out_puts(out, list_name);
+  out_puts(out, "> ");
+
+  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Returned rows");
+
+  return out_finish(out) == APR_SUCCESS ? rownum : -1;
+}
+
+typedef struct {
+  const char* key;
+  apr_int64_t count;
+  apr_int64_t sum;
+} agg_row;
+
+static agg_row* agg_add(apr_pool_t* p, apr_array_header_t* rows, apr_hash_t* index, const char* key){
+  agg_row* row = (agg_row*)apr_hash_get(index, key, APR_HASH_KEY_STRING);
+  if(row == NULL){
+    row = (agg_row*)apr_array_push(rows);
+    row->key = apr_pstrdup(p, key);
+    row->count = row->sum = 0;
+    apr_hash_set(index, row->key, APR_HASH_KEY_STRING, row);
+  }
+  return row;
+}
+
+/**
+ * Stream the result of a count query - the group_by value unless counting all records,
+ * COUNT(*) and SUM(sum) if sum is set - as a small table in the given format.
+ * When grouping by a list field, e.g. allowedVOs, each element of the list counts,
+ * so a node allowing two VOs is counted for both.
+ */
+int recs_aggregate_format(apr_pool_t* p, out_stream* out, ap_dbd_t* dbd, apr_dbd_results_t *res,
+   const char* group_by, const char* sum, int format, int table_num){
+  apr_dbd_row_t* row;
+  apr_array_header_t* rows = apr_array_make(p, 16, sizeof(agg_row));
+  apr_hash_t* index = apr_hash_make(p);
+  int grouped = *group_by != '\0';
+  const char* val;
+  const char* count_val;
+  const char* sum_val;
+  char* list;
+  char* elem;
+  char* last;
+  agg_row* agg;
+  int i;
+
+  for(row = NULL; apr_dbd_get_row(dbd->driver, p, res, &row, -1) == 0; row = NULL){
+    val = grouped ? apr_dbd_get_entry(dbd->driver, row, 0) : "";
+    count_val = apr_dbd_get_entry(dbd->driver, row, grouped);
+    sum_val = sum == NULL ? NULL : apr_dbd_get_entry(dbd->driver, row, grouped + 1);
+    if(val == NULL){
+      val = "";
+    }
+    if(grouped && is_list_field((char*)group_by)){
+      list = apr_pstrdup(p, val);
+      for(elem = apr_strtok(list, " ", &last); elem != NULL; elem = apr_strtok(NULL, " ", &last)){
+        agg = agg_add(p, rows, index, elem);
+        agg->count += apr_atoi64(count_val);
+        agg->sum += sum_val == NULL ? 0 : apr_atoi64(sum_val);
+      }
+    }
+    else{
+      agg = agg_add(p, rows, index, val);
+      agg->count += apr_atoi64(count_val);
+      agg->sum += sum_val == NULL ? 0 : apr_atoi64(sum_val);
+    }
+  }
+
+  if(format == XML_FORMAT){
+    out_puts(out, "<?xml version=\"1.0\"?>\n<");
+    out_puts(out, TABLE_LIST_NAMES[table_num]);
+    out_puts(out, ">");
+  }
+  else if(format == JSON_FORMAT){
+    out_puts(out, "{");
+    out_json_str(out, TABLE_LIST_NAMES[table_num], strlen(TABLE_LIST_NAMES[table_num]));
+    out_puts(out, ":[");
+  }
+  else{
+    if(grouped){
+      out_puts(out, group_by);
+      out_puts(out, "\t");
+    }
+    out_puts(out, COUNT_STR);
+    if(sum != NULL){
+      out_puts(out, "\t");
+      out_puts(out, sum);
+    }
+  }
+  for(i = 0; i < rows->nelts; ++i){
+    agg = &APR_ARRAY_IDX(rows, i, agg_row);
+    count_val = apr_psprintf(p, "%" APR_INT64_T_FMT, agg->count);
+    sum_val = apr_psprintf(p, "%" APR_INT64_T_FMT, agg->sum);
+    if(format == XML_FORMAT){
+      out_puts(out, "\n  <group>");
+      if(grouped){
+        out_xml_elem(out, "", group_by, agg->key);
+      }
+      out_xml_elem(out, "", COUNT_STR, count_val);
+      if(sum != NULL){
+        out_xml_elem(out, "", sum, sum_val);
+      }
+      out_puts(out, "</group>");
+    }
+    else if(format == JSON_FORMAT){
+      out_puts(out, i == 0 ? "\n{" : ",\n{");
+      if(grouped){
+        out_json_field(out, 1, group_by, agg->key);
+        out_puts(out, ",");
+      }
+      out_json_str(out, COUNT_STR, strlen(COUNT_STR));
+      out_puts(out, ":");
+      out_puts(out, count_val);
+      if(sum != NULL){
+        out_puts(out, ",");
+        out_json_str(out, sum, strlen(sum));
+        out_puts(out, ":");
+        out_puts(out, sum_val);
+      }
+      out_puts(out, "}");
+    }
+    else{
+      out_puts(out, "\n");
+      if(grouped){
+        out_puts(out, agg->key);
+        out_puts(out, "\t");
+      }
+      out_puts(out, count_val);
+      if(sum != NULL){
+        out_puts(out, "\t");
+        out_puts(out, sum_val);
+      }
+    }
+  }
+  if(format == XML_FORMAT){
+    out_puts(out, "\n</");
+    out_puts(out, TABLE_LIST_NAMES[table_num]);
+    out_puts(out, "> ");
+  }
+  else if(format == JSON_FORMAT){
+    out_puts(out, "\n]}");
+  }
+
+  return out_finish(out) == APR_SUCCESS ? rows->nelts : -1;
+}
+
+/**
+ * Response cache
+ *
+ * Formatted list responses are cached in shared memory, so the same listing asked for
+ * by many nodes within ResponseCacheTTL seconds is only selected and formatted once,
+ * by whichever Apache child gets it first. Entries are keyed on the base URL and the
+ * sorted query arguments, and store the body as sent - possibly gzip compressed - with
+ * its format, ETag and Last-Modified.
+ * Each table has a version which is bumped when the table is changed through this
+ * module; entries of an older version are treated as missing.
+ * The cache is a fixed array of ResponseCacheSlots slots of ResponseCacheSlotSize
+ * bytes; a key can be in one of RESPONSE_CACHE_WAYS slots, the least recently used
+ * of which is evicted. Larger responses are not cached, but counted.
+ */
+
+#define RESPONSE_CACHE_KEY_SIZE 512
+#define RESPONSE_CACHE_ETAG_SIZE 96
+
+/* Name of the mutex, as used with the Mutex directive. */
+static const char* RESPONSE_CACHE_MUTEX = "gridfactory-cache";
+
+typedef struct {
+  char key[RESPONSE_CACHE_KEY_SIZE];
+  int table_num;
+  apr_uint32_t version;
+  int format;
+  apr_time_t expires;
+  apr_time_t used;
+  apr_time_t mtime;
+  char etag[RESPONSE_CACHE_ETAG_SIZE];
+  apr_size_t len;
+} cache_slot;
+
+typedef struct {
+  /* Indexed by table number. */
+  apr_uint32_t versions[NODE_TABLE_NUM + 1];
+  apr_uint32_t hits;
+  apr_uint32_t misses;
+  apr_uint32_t stores;
+  apr_uint32_t evictions;
+  /* Responses larger than a slot. */
+  apr_uint32_t too_large;
+  /* The schema reload generation; see get_schema(). */
+  apr_uint32_t schema_generation;
+} cache_header;
+
+typedef struct {
+  apr_shm_t* shm;
+  apr_global_mutex_t* mutex;
+  const char* mutex_file;
+  cache_header* header;
+  /* Copied from response_cache_slots and response_cache_slot_size. */
+  int nslots;
+  apr_size_t slot_size;
+  /* nslots slots, following the header. */
+  cache_slot* slots;
+  /* The bodies; slot_size bytes per slot. */
+  char* data;
+} response_cache;
+
+static response_cache rcache;
+
+static int response_cache_pre_config(apr_pool_t* pconf, apr_pool_t* plog, apr_pool_t* ptemp){
+  ap_mutex_register(pconf, RESPONSE_CACHE_MUTEX, NULL, APR_LOCK_DEFAULT, 0);
+  /* The configuration may be re-read. */
+  response_cache_slots = DEFAULT_RESPONSE_CACHE_SLOTS;
+  response_cache_slot_size = DEFAULT_RESPONSE_CACHE_SLOT_SIZE;
+  return OK;
+}
+
+static int response_cache_post_config(apr_pool_t* pconf, apr_pool_t* plog, apr_pool_t* ptemp,
+   server_rec* s){
+  apr_size_t header_size = APR_ALIGN_DEFAULT(sizeof(cache_header));
+  apr_size_t slots_size;
+  apr_status_t rv;
+  rcache.nslots = response_cache_slots;
+  rcache.slot_size = response_cache_slot_size;
+  slots_size = APR_ALIGN_DEFAULT(rcache.nslots * sizeof(cache_slot));
+  schemas.generation = NULL;
+  /* Anonymous shared memory; inherited by the children. */
+  rv = apr_shm_create(&rcache.shm, header_size + slots_size + rcache.nslots * rcache.slot_size,
+     NULL, pconf);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to create response cache; caching is off.");
+    rcache.shm = NULL;
+    return OK;
+  }
+  rv = ap_global_mutex_create(&rcache.mutex, &rcache.mutex_file, RESPONSE_CACHE_MUTEX, NULL, s, pconf, 0);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to create response cache mutex; caching is off.");
+    rcache.shm = NULL;
+    return OK;
+  }
+  rcache.header = (cache_header*)apr_shm_baseaddr_get(rcache.shm);
+  rcache.slots = (cache_slot*)((char*)rcache.header + header_size);
+  memset(rcache.header, 0, header_size + slots_size);
+  schemas.generation = &rcache.header->schema_generation;
+  rcache.data = (char*)rcache.slots + slots_size;
+  return OK;
+}
+
+static void response_cache_child_init(apr_pool_t* pchild, server_rec* s){
+  apr_status_t rv;
+  if(rcache.shm == NULL){
+    return;
+  }
+  rv = apr_global_mutex_child_init(&rcache.mutex, rcache.mutex_file, pchild);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to attach to response cache mutex; caching is off.");
+    rcache.shm = NULL;
+  }
+}
+
+/* Invalidate the cached responses of a table. */
+static void response_cache_invalidate(int table_num){
+  if(rcache.shm == NULL){
+    return;
+  }
+  apr_global_mutex_lock(rcache.mutex);
+  ++rcache.header->versions[table_num];
+  apr_global_mutex_unlock(rcache.mutex);
+}
+
+/* Order query arguments. */
+static int cmp_args(const void* a, const void* b){
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * The key of the response to r, or NULL if it should not be cached.
+ * Compressed responses are cached compressed, under a key of their own.
+ * Requests with wait= are not cached: a cached empty listing would end the wait.
+ */
+static char* response_cache_key(apr_pool_t* p, request_rec* r, int priv, int gzip){
+  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
+  apr_array_header_t* args = apr_array_make(p, 8, sizeof(char*));
+  char* key;
+  char* buffer;
+  char* token;
+  char* last;
+  int i;
+  if(rcache.shm == NULL || conf->response_ttl_ <= 0 || r->method_number != M_GET ||
+     (r->args != NULL && get_arg(p, r->args, WAIT_STR) != NULL)){
+    return NULL;
+  }
+  if(r->args != NULL){
+    buffer = apr_pstrdup(p, r->args);
+    for(token = apr_strtok(buffer, "&", &last); token != NULL; token = apr_strtok(NULL, "&", &last)){
+      APR_ARRAY_PUSH(args, char*) = token;
+    }
+    qsort(args->elts, args->nelts, sizeof(char*), cmp_args);
+  }
+  /* The format may come from the Accept header. */
+  key = apr_psprintf(p, "%s\t%i\t%i\t%i\t", get_ctx(r)->base_url, priv, request_format(p, r), gzip);
+  for(i = 0; i < args->nelts; ++i){
+    key = apr_pstrcat(p, key, i == 0 ? "" : "&", APR_ARRAY_IDX(args, i, char*), NULL);
+  }
+  return strlen(key) < RESPONSE_CACHE_KEY_SIZE ? key : NULL;
+}
+
+/* First slot a key can be in. */
+static int response_cache_set(const char* key){
+  apr_ssize_t len = APR_HASH_KEY_STRING;
+  return (apr_hashfunc_default(key, &len) % (rcache.nslots / RESPONSE_CACHE_WAYS)) *
+     RESPONSE_CACHE_WAYS;
+}
+
+/* Whether a slot holds a current entry. Call with the mutex held. */
+static int response_cache_live(cache_slot* slot, apr_time_t now){
+  return slot->key[0] != '\0' && slot->expires > now &&
+     slot->version == rcache.header->versions[slot->table_num];
+}
+
+/**
+ * Serve the response to r from the cache. Returns OK if it was written, HTTP_NOT_MODIFIED
+ * if the client copy is current or DECLINED if there is no current entry. An entry stored
+ * for a gzip key is sent as it is, with Content-Encoding: gzip. In case of DECLINED
+ * *version is the version of the table to store the new response with.
+ */
+static int response_cache_serve(request_rec* r, apr_pool_t* p, const char* key, int table_num,
+   db_result* ret, apr_uint32_t* version, int gzip){
+  apr_time_t now = apr_time_now();
+  cache_slot* slot;
+  cache_slot found;
+  char* body = NULL;
+  int first = response_cache_set(key);
+  int i;
+  int status;
+
+  apr_global_mutex_lock(rcache.mutex);
+  *version = rcache.header->versions[table_num];
+  for(i = first; i < first + RESPONSE_CACHE_WAYS; ++i){
+    slot = &rcache.slots[i];
+    if(slot->key[0] == '\0' || strcmp(slot->key, key) != 0){
+      continue;
+    }
+    if(!response_cache_live(slot, now)){
+      slot->key[0] = '\0';
+      break;
+    }
+    slot->used = now;
+    found = *slot;
+    body = (char*)apr_palloc(p, slot->len + 1);
+    memcpy(body, rcache.data + (apr_size_t)i * rcache.slot_size, slot->len);
+    break;
+  }
+  if(body == NULL){
+    ++rcache.header->misses;
+  }
+  else{
+    ++rcache.header->hits;
+  }
+  apr_global_mutex_unlock(rcache.mutex);
+
+  if(body == NULL){
+    return DECLINED;
+  }
+  ret->format = found.format;
+  if(found.mtime > 0){
+    ap_update_mtime(r, found.mtime);
+    ap_set_last_modified(r);
+  }
+  if(found.etag[0] != '\0'){
+    apr_table_setn(r->headers_out, "ETag", apr_pstrdup(p, found.etag));
+  }
+  if((status = ap_meets_conditions(r)) != OK){
+    return status;
+  }
+  set_format_content_type(r, found.format);
+  if(gzip){
+    apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+  }
+  ap_rwrite(body, found.len, r);
+  return OK;
+}
+
+/* Store the response to r, unless the table was changed since version was read. */
+static void response_cache_store(request_rec* r, const char* key, int table_num,
+   apr_uint32_t version, int format, const char* body, apr_size_t len){
+  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
+  const char* etag = apr_table_get(r->headers_out, "ETag");
+  apr_time_t now = apr_time_now();
+  cache_slot* slot;
+  cache_slot* victim = NULL;
+  int first = response_cache_set(key);
+  int i;
+
+  apr_global_mutex_lock(rcache.mutex);
+  if(rcache.header->versions[table_num] != version){
+    apr_global_mutex_unlock(rcache.mutex);
+    return;
+  }
+  /* The same key, else a free or stale slot, else the least recently used one. */
+  for(i = first; i < first + RESPONSE_CACHE_WAYS; ++i){
+    slot = &rcache.slots[i];
+    if(slot->key[0] != '\0' && strcmp(slot->key, key) == 0){
+      victim = slot;
+      break;
+    }
+    if(victim == NULL || (response_cache_live(victim, now) &&
+       (!response_cache_live(slot, now) || slot->used < victim->used))){
+      victim = slot;
+    }
+  }
+  if(strcmp(victim->key, key) != 0 && response_cache_live(victim, now)){
+    ++rcache.header->evictions;
+  }
+  apr_cpystrn(victim->key, key, RESPONSE_CACHE_KEY_SIZE);
+  victim->table_num = table_num;
+  victim->version = version;
+  victim->format = format;
+  victim->expires = now + apr_time_from_sec(conf->response_ttl_);
+  victim->used = now;
+  victim->mtime = r->mtime;
+  apr_cpystrn(victim->etag, etag == NULL || strlen(etag) >= RESPONSE_CACHE_ETAG_SIZE ? "" : etag,
+     RESPONSE_CACHE_ETAG_SIZE);
+  victim->len = len;
+  memcpy(rcache.data + (apr_size_t)(victim - rcache.slots) * rcache.slot_size, body, len);
+  ++rcache.header->stores;
+  apr_global_mutex_unlock(rcache.mutex);
+}
+
+/* Count a response that was not stored, as it did not fit in a slot. */
+static void response_cache_too_large(){
+  apr_global_mutex_lock(rcache.mutex);
+  ++rcache.header->too_large;
+  apr_global_mutex_unlock(rcache.mutex);
+}
+
+/**
+ * Conditional GET
+ *
+ * Set ETag and Last-Modified from the lastModified of a record, or from the newest
+ * lastModified, the number of rows and a checksum of the rows of a limited listing, and
+ * check them against If-None-Match/If-Modified-Since. validator_query must return
+ * UNIX_TIMESTAMP(lastModified), optionally followed by a row count and a checksum;
+ * args are the values of its placeholders. select is the select
+ * list of the response and gzip tells if it will be compressed; each makes a different
+ * representation with an ETag of its own.
+ * Returns HTTP_NOT_MODIFIED if the copy of the client is current, OK otherwise.
+ */
+static int check_conditions(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd,
+   const char* validator_query, apr_array_header_t* args, int table_num, const char* select, int gzip){
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row = NULL;
+  const char* lm = NULL;
+  const char* count = "";
+  apr_int64_t lm_sec;
+
+  if(r->method_number != M_GET){
+    return OK;
+  }
+  if(stmt_select_row(r, p, dbd, &res, &row, validator_query, args) != 0){
+    return OK;
+  }
+  if(row != NULL){
+    lm = apr_dbd_get_entry(dbd->driver, row, 0);
+    if(apr_dbd_num_cols(dbd->driver, res) > 2){
+      count = apr_pstrcat(p, apr_dbd_get_entry(dbd->driver, row, 1), "-",
+         apr_dbd_get_entry(dbd->driver, row, 2), NULL);
+    }
+    else if(apr_dbd_num_cols(dbd->driver, res) > 1){
+      count = apr_dbd_get_entry(dbd->driver, row, 1);
+    }
+  }
+  /* No such record or an empty listing. */
+  if(lm == NULL || *lm == '\0'){
+    return OK;
+  }
+  lm_sec = apr_atoi64(lm);
+  ap_update_mtime(r, apr_time_from_sec(lm_sec));
+  ap_set_last_modified(r);
+  /* lastModified has a resolution of one second, so a record changed during this second
+   * may change again without its validator changing. Only give an ETag once it is stable. */
+  if(lm_sec < apr_time_sec(r->request_time)){
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    apr_table_setn(r->headers_out, "ETag", apr_psprintf(p, "\"%i-%s-%s-%i-%x%s\"",
+       table_num, lm, count, request_format(p, r), apr_hashfunc_default(select, &len),
+       gzip ? "-gzip" : ""));
+  }
+  if(table_num == HIST_TABLE_NUM && *count == '\0'){
+    apr_table_setn(r->headers_out, "Cache-Control", HIST_CACHE_CONTROL);
+  }
+  return ap_meets_conditions(r);
+}
+
+/**
+ * Query arguments of listings
+ *
+ * The arguments of GET /db/jobs|history|nodes/?... are URL-decoded and compiled once
+ * per request into a WHERE clause with %s placeholders, the values of these, and the
+ * ORDER BY/LIMIT clauses. Filters are ANDed together:
+ *   col=val            col = val
+ *   col=a,b,c          col IN (a, b, c) - except for userInfo and providerInfo
+ *   col>val, col>=val, col<val, col<=val
+ *                      ranges, on the columns of RANGE_FIELDS_STR only
+ *   orderBy=col,-col2  ORDER BY col, col2 DESC
+ *   limit=N            at most N rows, or the page size with after=
+ *   start=N&end=M      rows N to M
+ *   after=CURSOR       keyset pagination, see above
+ *   groupBy=col, count=1, sum=col
+ *                      counts instead of records; see recs_aggregate_format()
+ * Column names must be columns of the table.
+ */
+typedef struct {
+  /* " WHERE ..." or "". */
+  char* where;
+  apr_array_header_t* args;
+  /* " ORDER BY ... LIMIT ..." or "". */
+  char* tail;
+  /* Page size; 0 when the listing is not paged. */
+  int page_size;
+  /* Whether tail has a LIMIT, so that the listing reads a bounded number of rows. */
+  int limited;
+  /* Set if counts are asked for: the column to group by or "", and the column to add up or NULL. */
+  char* group_by;
+  char* sum;
+} list_query;
+
+/* Decode, in place, a query argument key or value. */
+static char* arg_decode(char* str){
+  urldecode2(str, str);
+  return str;
+}
+
+/**
+ * Compile the arguments of the listing requested by r, or get them from a previous call
+ * for the same request. Returns NULL on invalid arguments.
+ */
+static list_query* list_query_args(request_rec* r, table_schema* schema, int table_num){
+    apr_pool_t* p = r->pool;
+    list_query* q = NULL;
+    char* buffer;
+    char* last;
+    char* token;
+    char* key;
+    char* val;
+    char* raw;
+    char* last1;
+    char* op;
+    char* c;
+    char* order = "";
+    int start = -1;
+    int end = -1;
+    int limit = -1;
+    char* after = NULL;
+    char* after_lm;
+    char* after_id;
+    int i;
+    /* Conditions of the WHERE clause; they are ANDed together. */
+    apr_array_header_t* conds = apr_array_make(p, 4, sizeof(char*));
+
+    apr_pool_userdata_get((void**)&q, LIST_QUERY_KEY, p);
+    if(q != NULL){
+      return q;
+    }
+    q = (list_query*)apr_pcalloc(p, sizeof(list_query));
+    q->where = "";
+    q->tail = "";
+    q->args = apr_array_make(p, 4, sizeof(const char*));
+
+    buffer = apr_pstrdup(p, r->args ? r->args : "");
+    for(token = apr_strtok(buffer, "&", &last); token != NULL; token = apr_strtok(NULL, "&", &last)){
+      ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "token: %s", token);
+      /* Split at the first of =, < and >; DNs may hold more '='. */
+      c = token + strcspn(token, "=<>");
+      op = "=";
+      val = "";
+      if(*c == '<' || *c == '>'){
+        op = c[1] == '=' ? (*c == '<' ? "<=" : ">=") : (*c == '<' ? "<" : ">");
+        val = c + strlen(op);
+      }
+      else if(*c == '='){
+        val = c + 1;
+      }
+      *c = '\0';
+      key = arg_decode(token);
+      /* Lists are split before decoding, so that an encoded ',' (%2C) is part of a value. */
+      raw = strchr(val, ',') != NULL ? apr_pstrdup(p, val) : NULL;
+      val = arg_decode(val);
+
+      if(apr_strnatcmp(key, FORMAT_STR) == 0 || apr_strnatcmp(key, FIELDS_STR) == 0 ||
+         apr_strnatcmp(key, WAIT_STR) == 0){
+        /* Handled by request_format(), make_projection() and wait_for_recs(). */
+        continue;
+      }
+      if(*op != '='){
+        if(!has_field(RANGE_FIELDS_STR, key) || !is_field(schema, key)){
+          ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Cannot filter %s by range.", key);
+          return NULL;
+        }
+        APR_ARRAY_PUSH(conds, char*) = apr_pstrcat(p, "`", key, "` ", op, " %s", NULL);
+        APR_ARRAY_PUSH(q->args, const char*) = val;
+      }
+      else if(apr_strnatcmp(key, AFTER_STR) == 0){
+        after = val;
+      }
+      else if(apr_strnatcmp(key, LIMIT_STR) == 0){
+        limit = atoi(val);
+      }
+      else if(apr_strnatcmp(key, START_STR) == 0){
+        start = atoi(val);
+      }
+      else if(apr_strnatcmp(key, END_STR) == 0){
+        end = atoi(val);
+      }
+      else if(apr_strnatcmp(key, GROUP_BY_STR) == 0 || apr_strnatcmp(key, SUM_STR) == 0){
+        if(!is_field(schema, val) ||
+           (apr_strnatcmp(key, SUM_STR) == 0 && !has_field(SUM_FIELDS_STR, val))){
+          ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Cannot %s %s.", key, val);
+          return NULL;
+        }
+        if(apr_strnatcmp(key, SUM_STR) == 0){
+          q->sum = val;
+        }
+        else{
+          q->group_by = val;
+        }
+      }
+      else if(apr_strnatcmp(key, COUNT_STR) == 0){
+        if(q->group_by == NULL && atoi(val) > 0){
+          q->group_by = "";
+        }
+      }
+      else if(apr_strnatcmp(key, ORDER_BY_STR) == 0){
+        for(c = apr_strtok(val, ",", &last1); c != NULL; c = apr_strtok(NULL, ",", &last1)){
+          if(!is_field(schema, *c == '-' ? c + 1 : c)){
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Cannot order by %s.", c);
+            return NULL;
+          }
+          order = apr_pstrcat(p, order, *order == '\0' ? " ORDER BY `" : ", `",
+            *c == '-' ? c + 1 : c, *c == '-' ? "` DESC" : "`", NULL);
+        }
+      }
+      /* The column name goes into the query text, so it must be one of the table. */
+      else if(!is_field(schema, key)){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No such field: %s", key);
+        return NULL;
+      }
+      else if(raw != NULL && apr_strnatcmp(key, USER_DN_STR) != 0 &&
+         apr_strnatcmp(key, PROVIDER_DN_STR) != 0){
+        c = apr_pstrcat(p, "`", key, "` IN (", NULL);
+        for(i = 0, val = apr_strtok(raw, ",", &last1); val != NULL; val = apr_strtok(NULL, ",", &last1), ++i){
+          c = apr_pstrcat(p, c, i == 0 ? "%s" : ", %s", NULL);
+          APR_ARRAY_PUSH(q->args, const char*) = arg_decode(val);
+        }
+        if(i == 0){
+          ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No values for %s.", key);
+          return NULL;
+        }
+        APR_ARRAY_PUSH(conds, char*) = apr_pstrcat(p, c, ")", NULL);
+      }
+      else{
+        APR_ARRAY_PUSH(conds, char*) = apr_pstrcat(p, "`", key, "` = %s", NULL);
+        APR_ARRAY_PUSH(q->args, const char*) = val;
+      }
+    }
+    /* Keyset pagination: continue after the key of the cursor. */
+    if(after != NULL){
+      if(schema->lastmodified_col_nr < 0 || schema->id_col_nr < 0){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Table %i cannot be paged.", table_num);
+        return NULL;
+      }
+      q->page_size = limit > 0 && limit < MAX_SELECT_ROWS ? limit : DEFAULT_PAGE_SIZE;
+      if(*after != '\0'){
+        if(parse_page_token(p, after, &after_lm, &after_id) != 0){
+          ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid cursor: %s", after);
+          return NULL;
+        }
+        /* Written so that MySQL can do a range scan on (lastModified, identifier). */
+        APR_ARRAY_PUSH(conds, char*) = apr_pstrcat(p, LASTMODIFIED_COL, " >= %s AND (",
+          LASTMODIFIED_COL, " > %s OR ", ID_COL, " > %s)", NULL);
+        APR_ARRAY_PUSH(q->args, const char*) = after_lm;
+        APR_ARRAY_PUSH(q->args, const char*) = after_lm;
+        APR_ARRAY_PUSH(q->args, const char*) = after_id;
+      }
+    }
+    for(i = 0; i < conds->nelts; ++i){
+      q->where = apr_pstrcat(p, q->where, i == 0 ? " WHERE " : " AND ", APR_ARRAY_IDX(conds, i, char*), NULL);
+    }
+    if(q->sum != NULL && q->group_by == NULL){
+      q->group_by = "";
+    }
+    if(q->group_by != NULL){
+      /* Counts are neither ordered nor paged. */
+      q->page_size = 0;
+      q->tail = *q->group_by == '\0' ? "" : apr_pstrcat(p, " GROUP BY `", q->group_by, "`", NULL);
+    }
+    else if(q->page_size > 0){
+      if(start >= 0 || end >= 0 || *order != '\0'){
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Ignoring 'start', 'end' and 'orderBy' of paged request.");
+      }
+      q->tail = apr_pstrcat(p, " ORDER BY ", LASTMODIFIED_COL, ", ", ID_COL,
+        " LIMIT ", apr_itoa(p, q->page_size), NULL);
+      q->limited = 1;
+    }
+    else if(start > 0 && end < 0){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "When specifying 'start' you MUST specify 'end' as well.");
+      return NULL;
+    }
+    else if(start >= 0 && end >= 0){
+      q->tail = apr_pstrcat(p, order, " LIMIT ", apr_itoa(p, start), ",", apr_itoa(p, end - start +1), NULL);
+      q->limited = 1;
+    }
+    else if(start < 0 && end >= 0){
+      q->tail = apr_pstrcat(p, order, " LIMIT ", apr_itoa(p, end +1), NULL);
+      q->limited = 1;
+    }
+    else if(limit > 0){
+      q->tail = apr_pstrcat(p, order, " LIMIT ", apr_itoa(p, limit < MAX_SELECT_ROWS ? limit : MAX_SELECT_ROWS), NULL);
+      q->limited = 1;
+    }
+    else{
+      q->tail = order;
+    }
+
+    apr_pool_userdata_setn(q, LIST_QUERY_KEY, NULL, p);
+    return q;
+}
+
+/**
+ * Long polling
+ *
+ * GET /db/jobs/?...&wait=N waits up to N seconds for the listing to be non-empty.
+ * Instead of each waiting request polling MySQL, one watcher thread per Apache child
+ * polls JOB_RECS_WATCH_Q, and only while requests are waiting. When the result changes,
+ * it bumps the generation and wakes the waiters, which then re-check their own listing.
+ * The watcher uses the database of the server (virtual host) of the first waiting request.
+ * On an event MPM a waiting request is suspended and does not hold a worker thread.
+ */
+typedef struct {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t* mutex;
+    /* Broadcast when generation is bumped. */
+    apr_thread_cond_t* changed;
+    /* Signalled when the first request starts waiting and on shutdown. */
+    apr_thread_cond_t* wake;
+    apr_thread_t* thread;
+#endif
+    /* The server of the first waiting request, whose DBD configuration is used. */
+    server_rec* s;
+    volatile apr_uint32_t generation;
+    int waiters;
+    int stop;
+    /* The last result of JOB_RECS_WATCH_Q. */
+    char validator[64];
+    apr_uint32_t polls;
+} job_watch;
+
+static job_watch watch;
+
+/* State of a waiting request, kept in its request context. */
+typedef struct wait_state {
+    request_rec* r;
+    apr_time_t deadline;
+    /* The generation of the watcher when the listing was last found empty. */
+    apr_uint32_t generation;
+    int joined;
+} wait_state;
+
+static int gridfactory_db_handler(request_rec *r);
+
+#if APR_HAS_THREADS
+static void watch_join(server_rec* s){
+  apr_thread_mutex_lock(watch.mutex);
+  if(watch.waiters++ == 0){
+    watch.s = s;
+    apr_thread_cond_signal(watch.wake);
+  }
+  apr_thread_mutex_unlock(watch.mutex);
+}
+
+static void watch_leave(){
+  apr_thread_mutex_lock(watch.mutex);
+  --watch.waiters;
+  apr_thread_mutex_unlock(watch.mutex);
+}
+
+/**
+ * Block until the generation of the watcher is no longer gen or the deadline is reached.
+ * Returns 1 if the generation changed, 0 if not.
+ */
+static int watch_wait(server_rec* s, apr_uint32_t gen, apr_time_t deadline){
+  apr_time_t now;
+  int changed;
+  watch_join(s);
+  apr_thread_mutex_lock(watch.mutex);
+  while(watch.generation == gen && !watch.stop && (now = apr_time_now()) < deadline){
+    apr_thread_cond_timedwait(watch.changed, watch.mutex, deadline - now);
+  }
+  changed = watch.generation != gen;
+  apr_thread_mutex_unlock(watch.mutex);
+  watch_leave();
+  return changed;
+}
+
+/* Run JOB_RECS_WATCH_Q on a connection of its own to the database of s. Returns NULL on failure. */
+static char* watch_validator(apr_pool_t* p, server_rec* s){
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row = NULL;
+  char* ret = NULL;
+  ap_dbd_t* dbd = dbd_open_fn(p, s);
+  if(dbd == NULL){
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Failed to open database connection for the watcher.");
+    return NULL;
+  }
+  /* Unbuffered, read to the end: on buffered results rows are numbered from 1. */
+  if(apr_dbd_select(dbd->driver, p, dbd->handle, &res, JOB_RECS_WATCH_Q, 0) == 0){
+    for(row = NULL; apr_dbd_get_row(dbd->driver, p, res, &row, -1) == 0; row = NULL){
+      ret = apr_pstrcat(p, apr_dbd_get_entry(dbd->driver, row, 0), "\t",
+         apr_dbd_get_entry(dbd->driver, row, 1), NULL);
+    }
+  }
+  else{
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Query execution error in watch_validator: %s",
+       apr_dbd_error(dbd->driver, dbd->handle, 0));
+  }
+  dbd_close_fn(s, dbd);
+  return ret;
+}
+
+static void* APR_THREAD_FUNC watch_thread(apr_thread_t* thd, void* data){
+  apr_pool_t* p;
+  server_rec* s;
+  char* validator;
+  apr_pool_create(&p, apr_thread_pool_get(thd));
+  apr_thread_mutex_lock(watch.mutex);
+  while(!watch.stop){
+    if(watch.waiters == 0){
+      apr_thread_cond_wait(watch.wake, watch.mutex);
+      continue;
+    }
+    s = watch.s;
+    apr_thread_mutex_unlock(watch.mutex);
+    apr_pool_clear(p);
+    validator = watch_validator(p, s);
+    apr_thread_mutex_lock(watch.mutex);
+    ++watch.polls;
+    if(validator != NULL && strcmp(validator, watch.validator) != 0){
+      apr_cpystrn(watch.validator, validator, sizeof(watch.validator));
+      apr_atomic_inc32(&watch.generation);
+      apr_thread_cond_broadcast(watch.changed);
+    }
+    if(!watch.stop){
+      apr_thread_cond_timedwait(watch.wake, watch.mutex, WATCH_INTERVAL);
+    }
+  }
+  apr_thread_mutex_unlock(watch.mutex);
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t watch_stop(void* data){
+  apr_status_t rv;
+  apr_thread_mutex_lock(watch.mutex);
+  watch.stop = 1;
+  apr_thread_cond_broadcast(watch.wake);
+  apr_thread_cond_broadcast(watch.changed);
+  apr_thread_mutex_unlock(watch.mutex);
+  apr_thread_join(&rv, watch.thread);
+  watch.thread = NULL;
+  return APR_SUCCESS;
+}
+#endif
+
+static void watch_init(apr_pool_t* pchild, server_rec* s){
+#if APR_HAS_THREADS
+  apr_status_t rv;
+  if(dbd_open_fn == NULL || dbd_close_fn == NULL){
+    return;
+  }
+  if((rv = apr_thread_mutex_create(&watch.mutex, APR_THREAD_MUTEX_DEFAULT, pchild)) != APR_SUCCESS ||
+     (rv = apr_thread_cond_create(&watch.changed, pchild)) != APR_SUCCESS ||
+     (rv = apr_thread_cond_create(&watch.wake, pchild)) != APR_SUCCESS ||
+     (rv = apr_thread_create(&watch.thread, NULL, watch_thread, NULL, pchild)) != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to start the job watcher; wait= is ignored.");
+    watch.thread = NULL;
+    return;
+  }
+  /* Before the pool of the thread is destroyed. */
+  apr_pool_pre_cleanup_register(pchild, NULL, watch_stop);
+#endif
+}
+
+/**
+ * Returns 1 if the listing requested by r has at least one row, 0 if not,
+ * -1 on error. Uses a connection of its own, so none is held while waiting.
+ */
+static int recs_exist(apr_pool_t* p, request_rec* r, int table_num){
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row = NULL;
+  table_schema* schema;
+  list_query* q;
+  int found = -1;
+  ap_dbd_t* dbd = dbd_open_fn(p, r->server);
+  if(dbd == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to open database connection.");
+    return -1;
+  }
+  if((schema = get_schema(r, p, dbd, table_num)) != NULL &&
+     (q = list_query_args(r, schema, table_num)) != NULL &&
+     stmt_select_row(r, p, dbd, &res, &row, apr_pstrcat(p, apr_psprintf(p, RECS_EXIST_Q,
+       TABLE_NAMES[table_num]), q->where, " LIMIT 1", NULL), q->args) == 0){
+    found = row != NULL;
+  }
+  dbd_close_fn(r->server, dbd);
+  return found;
+}
+
+#if APR_HAS_THREADS
+/**
+ * Timed callback of a suspended request. Cheaply checks the watcher; once
+ * jobDefinition changed or the deadline passed, runs the handler again, which either
+ * serves the listing or suspends the request anew. As in mod_dialup, the request is
+ * only touched holding its invoke_mtx, which is released before the request is
+ * finished, as that may destroy the pool of the mutex.
+ */
+static void wait_callback(void* baton){
+  wait_state* ws = (wait_state*)baton;
+  request_rec* r = ws->r;
+  int status;
+  apr_thread_mutex_lock(r->invoke_mtx);
+  if(apr_atomic_read32(&watch.generation) == ws->generation && apr_time_now() < ws->deadline &&
+     ap_mpm_register_timed_callback(WAIT_POLL_INTERVAL, wait_callback, ws) == APR_SUCCESS){
+    apr_thread_mutex_unlock(r->invoke_mtx);
+    return;
+  }
+  watch_leave();
+  ws->joined = 0;
+  status = gridfactory_db_handler(r);
+  apr_thread_mutex_unlock(r->invoke_mtx);
+  if(status == SUSPENDED){
+    return;
+  }
+  if(status == OK || status == DONE){
+    ap_finalize_request_protocol(r);
+  }
+  else{
+    ap_die(status, r);
+  }
+  ap_process_request_after_handler(r);
+}
+#endif
+
+/**
+ * For GET /db/jobs/?...&wait=N: return once the listing is non-empty or N seconds
+ * have passed, or SUSPENDED if the request was handed to wait_callback().
+ */
+static int wait_for_recs(apr_pool_t* p, request_rec* r, int table_num){
+  request_ctx* ctx = get_ctx(r);
+  wait_state* ws = ctx->wait;
+  char* wait;
+  if(ws == NULL){
+    wait = r->args ? get_arg(p, r->args, WAIT_STR) : NULL;
+    if(wait == NULL || atoi(wait) <= 0){
+      return OK;
+    }
+    ws = (wait_state*)apr_pcalloc(r->pool, sizeof(wait_state));
+    ws->r = r;
+    ws->deadline = r->request_time + apr_time_from_sec(atoi(wait) < MAX_WAIT ? atoi(wait) : MAX_WAIT);
+    ctx->wait = ws;
+  }
+#if APR_HAS_THREADS
+  int async = 0;
+  if(watch.thread == NULL){
+    return OK;
+  }
+  if(ap_mpm_query(AP_MPMQ_IS_ASYNC, &async) != APR_SUCCESS){
+    async = 0;
+  }
+  for(;;){
+    /* Read before checking, so that a change during the check is not missed. */
+    ws->generation = apr_atomic_read32(&watch.generation);
+    if(apr_time_now() >= ws->deadline || recs_exist(p, r, table_num) != 0){
+      return OK;
+    }
+    if(async){
+      if(!ws->joined){
+        watch_join(r->server);
+        ws->joined = 1;
+      }
+      if(ap_mpm_register_timed_callback(WAIT_POLL_INTERVAL, wait_callback, ws) == APR_SUCCESS){
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Suspending %s", r->uri);
+        return SUSPENDED;
+      }
+      watch_leave();
+      ws->joined = 0;
+      async = 0;
+    }
+    if(!watch_wait(r->server, ws->generation, ws->deadline)){
+      return OK;
+    }
+  }
+#endif
+  return OK;
 }
 
 /**
@@ -798,120 +2997,47 @@ char* recs_xml_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t *res,
  * is the tab separated list of fields.
  * Setting the switch 'priv' to 1 turns on privacy. Privacy means that only the fields of
  * 'pub_fields' are shown.
+ * With ?fields=a,b,... only those fields are shown. Either way, only the fields shown
+ * (plus identifier and lastModified) are selected.
+ * With ?after=[&limit=N] the listing is paged by (lastModified, identifier): a full page
+ * ends with a nextPage cursor, to be passed as 'after' to get the following page.
  */
 db_result* get_recs(request_rec* r, apr_pool_t* p, db_result* ret, int priv, int table_num){
     apr_dbd_results_t *res = NULL;
-    char* last;
-    char* last1;
-    char* token;
-    char* subtoken1;
-    char* subtoken2;
-    int start = -1;
-    int end = -1;
+    list_page page = {0};
+    list_query* q;
     ret->format = 0;
-    char* query = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-    char* fields_str = (char*)apr_pcalloc(p, 512 * sizeof(char*));
-    char** fields;
-    char* pub_fields_str = (char*)apr_pcalloc(p, 512 * sizeof(char*));
-    char* fields_query = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-    char** pub_fields = (char**)apr_pcalloc(p, 256 * sizeof(char**));
-
-    //apr_cpystrn(query, JOB_RECS_SELECT_Q, strlen(JOB_RECS_SELECT_Q)+1);
-    switch(table_num){
-      case JOB_TABLE_NUM:
-        snprintf(query, strlen(JOB_RECS_SELECT_Q)+1, "%s", JOB_RECS_SELECT_Q);
-        apr_cpystrn(fields_query, JOB_REC_SHOW_F_Q, strlen(JOB_REC_SHOW_F_Q)+1);
-        apr_cpystrn(pub_fields_str, JOB_PUB_FIELDS_STR, strlen(JOB_PUB_FIELDS_STR)+1);
-        break;
-      case HIST_TABLE_NUM:
-        snprintf(query, strlen(HIST_RECS_SELECT_Q)+1, "%s", HIST_RECS_SELECT_Q);
-        apr_cpystrn(fields_query, HIST_REC_SHOW_F_Q, strlen(HIST_REC_SHOW_F_Q)+1);
-        apr_cpystrn(pub_fields_str, JOB_PUB_FIELDS_STR, strlen(JOB_PUB_FIELDS_STR)+1);
-        break;
-      case NODE_TABLE_NUM:
-        snprintf(query, strlen(NODE_RECS_SELECT_Q)+1, "%s", NODE_RECS_SELECT_Q);
-        apr_cpystrn(fields_query, NODE_REC_SHOW_F_Q, strlen(NODE_REC_SHOW_F_Q)+1);
-        apr_cpystrn(pub_fields_str, NODE_PUB_FIELDS_STR, strlen(NODE_PUB_FIELDS_STR)+1);
-        break;
-      default:
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Invalid path: %i --> %s", table_num, r->uri);
-    }
-
-    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query0: %s", query);
-
-    /* For URLs like
-     * GET /db/jobs/?format=text|xml&csStatus=ready|requested|running&...
-     * append WHERE statements to query.*/
-    if(r->args && countchr(r->args, "=") > 0){
-      char buffer[strlen(r->args)+1];
-      snprintf(buffer, strlen(r->args)+1, "%s", r->args);
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "args: %s", buffer);
-
-      for ((token = strtok_r(buffer, "&", &last)); token;
-         token = strtok_r(NULL, "&", &last)) {
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "token: %s", token);
-        subtoken1 = strtok_r(token, "=", &last1);
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken1: %s", subtoken1);
-        if(apr_strnatcmp(subtoken1, FORMAT_STR) == 0){
-          subtoken2 = strtok_r(NULL, "=", &last1);
-          if(apr_strnatcmp(subtoken2, TEXT_FORMAT_STR) == 0){
-            ret->format = TEXT_FORMAT;
-          }
-          else if(apr_strnatcmp(subtoken2, XML_FORMAT_STR) == 0){
-            ret->format = XML_FORMAT;
-          }
-          else{
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Format %s unknown.", subtoken2);
-            //return NULL;
-          }
-        }
-        else if(apr_strnatcmp(subtoken1, START_STR) != 0 &&
-                apr_strnatcmp(subtoken1, END_STR) != 0 &&
-                apr_strnatcmp(subtoken1, USER_DN_STR) != 0 &&
-                apr_strnatcmp(subtoken1, PROVIDER_DN_STR) != 0){
-          subtoken2 = strtok_r(NULL, "=", &last1);
-          ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken2: %s", subtoken2);
-          query = apr_pstrcat(p, query, " WHERE ", subtoken1, " = '", subtoken2, "'", NULL);
-        }
-        else if(apr_strnatcmp(subtoken1, START_STR) == 0){
-          subtoken2 = strtok_r(NULL, "=", &last1);
-          ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken2: %s", subtoken2);
-          start = atoi(subtoken2);
-        }
-        else if(apr_strnatcmp(subtoken1, END_STR) == 0){
-          subtoken2 = strtok_r(NULL, "=", &last1);
-          ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken2: %s", subtoken2);
-          end = atoi(subtoken2);
-        }
-        else if(apr_strnatcmp(subtoken1, USER_DN_STR) == 0){
-          subtoken2 = strtok_r(NULL, "", &last1);
-          ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken2: %s", subtoken2);
-          query = apr_pstrcat(p, query, " WHERE ", subtoken1, " = '", subtoken2, "'", NULL);
-        }
-        else if(apr_strnatcmp(subtoken1, PROVIDER_DN_STR) == 0){
-          subtoken2 = strtok_r(NULL, "", &last1);
-          ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken2: %s", subtoken2);
-          query = apr_pstrcat(p, query, " WHERE ", subtoken1, " = '", subtoken2, "'", NULL);
-        }
-      }
-      if(start > 0 && end < 0){
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "When specifying 'start' you MUST specify 'end' as well.");
-        return NULL;
-      }
-      else if(start >= 0 && end >= 0){
-        query = apr_pstrcat(p, query, " LIMIT ", apr_itoa(p, start), ",", apr_itoa(p, end - start +1), NULL);
+    char* query;
+    table_schema* schema;
+    projection* pr;
+    const char* select;
+    const char* pub_fields_str = table_num == NODE_TABLE_NUM ? NODE_PUB_FIELDS_STR : JOB_PUB_FIELDS_STR;
+
+    if(table_num < JOB_TABLE_NUM || table_num > NODE_TABLE_NUM){
+      ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Invalid path: %i --> %s", table_num, r->uri);
+      return NULL;
+    }
+
+    /* Listings are compressed if the client accepts it. */
+    int gzip = accepts_gzip(r);
+    apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+
+    /* The response may already be in the cache shared by all children. */
+    apr_uint32_t version = 0;
+    char* cache_key = response_cache_key(p, r, priv, gzip);
+    if(cache_key != NULL){
+      int status = response_cache_serve(r, p, cache_key, table_num, ret, &version, gzip);
+      if(status == OK){
+        ret->streamed = 1;
+        return ret;
       }
-      else if(start < 0 && end >= 0){
-        query = apr_pstrcat(p, query, " LIMIT ", apr_itoa(p, end +1), NULL);
+      if(status != DECLINED){
+        ret->http_status = status;
+        return ret;
       }
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s", query);
-    }
-    /* For a plain URL like GET /db/jobs/, just use query unmodified. */
-    else{
-      ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "GET with no args");
     }
 
-   /* If outputting text, set fields. Be ware, after select,
+   /* Get the (cached) fields. Be ware, after select,
       results MUST be traversed before another select can be done. */
     ap_dbd_t* dbd;// = (ap_dbd_t*)apr_pcalloc(p, sizeof(ap_dbd_t*));
     dbd = dbd_acquire_fn(r);
@@ -919,32 +3045,102 @@ db_result* get_recs(request_rec* r, apr_pool_t* p, db_result* ret, int priv, int
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to acquire database connection.");
         return NULL;
     }
-    if((fields=set_fields(p, dbd, fields_str, fields_query))==NULL){
+    if((schema=get_schema(r, p, dbd, table_num))==NULL){
       ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to set fields.");
       return NULL;
     }
-    if(ret->format == TEXT_FORMAT){
-      if(tokenize_fields_str(p, pub_fields_str, pub_fields, "\t") < 0 && priv){
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to set public fields.");
-        return NULL;
+
+    ret->format = request_format(p, r);
+    if((q = list_query_args(r, schema, table_num)) == NULL){
+      ret->http_status = HTTP_BAD_REQUEST;
+      return ret;
+    }
+    page.size = q->page_size;
+
+    /* Counts, grouped by a column; with privacy, only public columns can be used. */
+    if(q->group_by != NULL){
+      if(priv && ((*q->group_by != '\0' && !has_field(pub_fields_str, q->group_by)) ||
+         (q->sum != NULL && !has_field(pub_fields_str, q->sum)))){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Cannot count by private fields.");
+        ret->http_status = HTTP_BAD_REQUEST;
+        return ret;
+      }
+      pr = NULL;
+      select = apr_pstrcat(p, *q->group_by == '\0' ? "" : apr_pstrcat(p, "`", q->group_by, "`, ", NULL),
+        "COUNT(*)", q->sum == NULL ? "" : apr_pstrcat(p, ", SUM(`", q->sum, "`)", NULL), NULL);
+    }
+    /* Select only the columns to be returned. XML listings have a fixed set of fields. */
+    else{
+      const char* wanted = r->args ? get_arg(p, r->args, FIELDS_STR) : NULL;
+      if(ret->format == XML_FORMAT && (wanted == NULL || *wanted == '\0')){
+        wanted = table_num == NODE_TABLE_NUM ? NODE_XML_FIELDS_STR : JOB_XML_FIELDS_STR;
       }
+      if((pr = make_projection(p, schema, wanted, priv, 1)) == NULL){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid fields: %s", wanted);
+        ret->http_status = HTTP_BAD_REQUEST;
+        return ret;
+      }
+      page.lastmodified_col_nr = pr->lastmodified_col_nr;
+      page.id_col_nr = pr->id_col_nr;
+      select = pr->select;
+    }
+
+    query = apr_pstrcat(p, apr_psprintf(p, RECS_SELECT_Q, select, TABLE_NAMES[table_num]),
+      q->where, q->tail, NULL);
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s", query);
+
+    /* Reply 304 if the listing has not changed since the client got it. The validator
+       reads the rows of the listing once more, so it is only computed for listings with a
+       LIMIT: for the others it would be a second scan of all matching rows. */
+    if(q->limited && q->group_by == NULL && (ret->http_status = check_conditions(r, p, dbd,
+       apr_pstrcat(p, apr_psprintf(p, RECS_VALIDATOR_Q, TABLE_NAMES[table_num]), q->where,
+          q->tail, RECS_VALIDATOR_END, NULL),
+       q->args, table_num, select, gzip)) != OK){
+      return ret;
     }
 
     /* Now do the query */
-    if(apr_dbd_select(dbd->driver, p, dbd->handle, &res, query, 0) != 0){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Query execution error in get_recs.");
+    if(stmt_select(r, p, dbd, &res, query, q->args, 0) != 0){
       return NULL;
     }
 
-    // format result
-    if(ret->format == TEXT_FORMAT){
+    // format result, streaming it to the client
+    out_stream out;
+    int nrows = 0;
+    out_init(&out, r, p);
+    if(gzip){
+      out_gzip(&out, p);
+    }
+    if(cache_key != NULL){
+      out_capture(&out, p, rcache.slot_size);
+    }
+    set_format_content_type(r, ret->format);
+    if(q->group_by != NULL){
+      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Returning counts");
+      nrows = recs_aggregate_format(p, &out, dbd, res, q->group_by, q->sum, ret->format, table_num);
+    }
+    else if(ret->format == TEXT_FORMAT){
       ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Returning text");
-      ret->res = recs_text_format(p, dbd, res, priv, pub_fields_str, fields_str, fields);
+      nrows = recs_text_format(p, &out, dbd, res, pr, &page);
     }
     else if(ret->format == XML_FORMAT){
       ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Returning XML");
-      ret->res = recs_xml_format(p, dbd, res, priv, table_num);
+      nrows = recs_xml_format(p, &out, dbd, res, pr, table_num, &page);
+    }
+    else if(ret->format == JSON_FORMAT){
+      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Returning JSON");
+      nrows = recs_json_format(p, &out, dbd, res, pr, table_num, &page);
+    }
+    ret->streamed = 1;
+    if(cache_key != NULL && nrows >= 0){
+      if(out.capture != NULL){
+        response_cache_store(r, cache_key, table_num, version, ret->format, out.capture, out.captured);
+      }
+      else{
+        response_cache_too_large();
+      }
     }
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Returned %i rows", nrows);
 
     // Dont't do this. It causes segfaults...
     //dbd->pool = NULL;
@@ -953,60 +3149,16 @@ db_result* get_recs(request_rec* r, apr_pool_t* p, db_result* ret, int priv, int
     return ret;
 }
 
-void get_rec_s(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
-   char* uuid, char* query){
-  char* my_query = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-  snprintf(my_query, strlen(query)+strlen(uuid)-1, query, uuid);
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Query: %s", my_query);
-  if(apr_dbd_select(dbd->driver, p, dbd->handle, &res, my_query, 0) != 0){
-    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Query execution error in get_rec_s.");
-  }
-}
-
-void get_rec_ps(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
-   char* uuid, int table_num){
-
-    apr_dbd_prepared_t* statement = NULL;
-    char* str = NULL;
-
-    switch(table_num){
-      case JOB_TABLE_NUM:
-        statement = apr_hash_get(dbd->prepared, LABEL, APR_HASH_KEY_STRING);
-        str = apr_pstrcat(p, "%", uuid, NULL);
-        break;
-      case HIST_TABLE_NUM:
-        statement = apr_hash_get(dbd->prepared, LABEL2, APR_HASH_KEY_STRING);
-        str = apr_pstrcat(p, "/%", uuid, NULL);
-        break;
-      case NODE_TABLE_NUM:
-        statement = apr_hash_get(dbd->prepared, LABEL3, APR_HASH_KEY_STRING);
-        str = apr_pstrcat(p, "/%", uuid, NULL);
-        break;
-      default:
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, "Invalid path: %i", table_num);
-    }
-
-    if(statement == NULL){
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p,
-                      "A prepared statement could not be found for getting job records.");
-    }
-
-    if(apr_dbd_pvselect(dbd->driver, p, dbd->handle, &res, statement,
-                              0, str, NULL) != 0) {
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p,
-                      "Query execution error looking up '%s' in database", uuid);
-    }
-}
-
 void rec_text_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
-   db_result* ret, char** fields){
+   db_result* ret, const column_desc** descs){
 
     apr_dbd_row_t* row;
     apr_status_t rv;
     char* val;
     int i;
     int firstrow = 0;
-    char* rec = "";
+    str_buf rec;
+    buf_init(&rec, p);
 
     //int numrows = apr_dbd_num_tuples(dbd->driver,res);
     int cols = apr_dbd_num_cols(dbd->driver,res);
@@ -1018,21 +3170,21 @@ void rec_text_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
          break;
       }
       if(firstrow != 0){
-        rec = apr_pstrcat(p, rec, "\n\n", NULL);
+        buf_write(&rec, "\n\n", 2);
       }
       for(i = 0 ; i < cols ; i++){
         val = (char*) apr_dbd_get_entry(dbd->driver, row, i);
         //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "--> %s", val);
         if(i > 0){
-          rec = apr_pstrcat(p, rec, "\n", NULL);
+          buf_write(&rec, "\n", 1);
         }
-        rec = apr_pstrcat(p, rec, fields[i], ": ", val, NULL);
+        buf_cat(&rec, descs[i]->name, ": ", val == NULL ? "" : val, NULL);
         // Set res.status
-        if(strcmp(fields[i], STATUS_COL) == 0 && val != NULL){
+        if(descs[i]->role == ROLE_STATUS && val != NULL){
           ret->status = val;
         }
         // Set res.providerInfo
-        else if(strcmp(fields[i], PROVIDERINFO_COL) == 0 && val != NULL){
+        else if(descs[i]->role == ROLE_PROVIDERINFO && val != NULL){
           ret->providerInfo = val;
         }
       }
@@ -1045,73 +3197,30 @@ void rec_text_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
     }
 
     //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Returning record:");
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%s", rec);
-
-    ret->res = rec;
-}
-
-static int is_list_field(char* field){
-  // allowedVOs, hypervisors, inputFileURLs, runtimeEnvironments
-  if(strcmp(field, ALLOWED_VOS_COL) == 0){
-    return 1;
-  }
-  else if(strcmp(field, HYPERVISORS_COL) == 0){
-    return 1;
-  }
-  else if(strcmp(field, INPUT_FILE_URLS_COL) == 0){
-    return 1;
-  }
-  else if(strcmp(field, RUNTIME_ENVIRONMENTS_COL) == 0){
-    return 1;
-  }
-  return 0;
-}
-
-static int is_out_file_mapping_field(char* field){
-  if(strcmp(field, OUT_FILE_MAPPING_COL) == 0){
-    return 1;
-  }
-  return 0;
-}
-
-static char* list_xml_format(apr_pool_t* p, char* val, char* sub_field){
-  char** fields = (char**)apr_pcalloc(p, 256 * sizeof(char**));
-  char* tmp_val = "";
-  int cols = tokenize_fields_str(p, val, fields, " ");
-  int i;
-  for(i = 0 ; i < cols ; i++){
-    tmp_val = apr_pstrcat(p, tmp_val, "\n    <", sub_field, ">", fields[i],
-       "</", sub_field, ">", NULL);
-  }
-  tmp_val = apr_pstrcat(p, tmp_val, "\n  ", NULL);
-  return tmp_val;
-}
+    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%s", rec.data);
 
-static char* out_file_map_format(apr_pool_t* p, char* val){
-  char** fields = (char**)apr_pcalloc(p, 256 * sizeof(char**));
-  char* tmp_val = "";
-  int i;
-  int cols = tokenize_fields_str(p, val, fields, " ");
-  for(i = 0 ; i < cols ; i = i + 2){
-    tmp_val = apr_pstrcat(p, tmp_val, "\n    <source>", fields[i],
-       "</source>", "<destination>", fields[i+1], "</destination>", NULL);
-  }
-  tmp_val = apr_pstrcat(p, tmp_val, "\n  ", NULL);
-  return tmp_val;
+    ret->res = rec.data;
 }
 
-void rec_xml_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
-   db_result* ret, char** fields, char* rec_name){
+/**
+ * Stream res as an XML document with a root element rec_name. List fields
+ * are expanded into one element per entry, straight from the cell value.
+ */
+void rec_xml_format(apr_pool_t* p, out_stream* out, ap_dbd_t* dbd, apr_dbd_results_t* res,
+   db_result* ret, const column_desc** descs, char* rec_name, const char* xsl_dir){
 
     apr_dbd_row_t* row;
     apr_status_t rv;
-    char* val = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-    char* sub_field = (char*)apr_pcalloc(p, 256 * sizeof(char*));
+    char* val;
     int i;
     int firstrow = 0;
-    char* rec = "<?xml version=\"1.0\"?>\n<?xml-stylesheet type=\"text/xsl\" href=\"";
-    rec = apr_pstrcat(p, rec, xsl_dir, rec_name, ".xsl\"?>\n<", rec_name, ">", NULL);
-    char* tmp_val;
+
+    out_puts(out, "<?xml version=\"1.0\"?>\n<?xml-stylesheet type=\"text/xsl\" href=\"");
+    out_puts(out, xsl_dir);
+    out_puts(out, rec_name);
+    out_puts(out, ".xsl\"?>\n<");
+    out_puts(out, rec_name);
+    out_write(out, ">", 1);
 
     //int numrows = apr_dbd_num_tuples(dbd->driver,res);
     int cols = apr_dbd_num_cols(dbd->driver,res);
@@ -1123,33 +3232,20 @@ void rec_xml_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
          break;
       }
       if(firstrow != 0){
-        rec = apr_pstrcat(p, rec, "\n\n", NULL);
+        out_write(out, "\n\n", 2);
       }
       for(i = 0 ; i < cols ; i++){
         val = (char*) apr_dbd_get_entry(dbd->driver, row, i);
         //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "--> %s", val);
         if(val && strcmp(val, "") != 0){
-          // Format allowedVOs, hypervisors, inputFileURLs, runtimeEnvironments
-          if(is_list_field(fields[i])){
-            apr_cpystrn(sub_field, fields[i], strlen(fields[i]));
-            tmp_val = list_xml_format(p, val, sub_field);
-          }
-          // Format outFileMapping
-          else if(is_out_file_mapping_field(fields[i])){
-            tmp_val = out_file_map_format(p, val);
-          }
-          else{
-            tmp_val = val;
-          }
-          rec = apr_pstrcat(p, rec, "\n  <", fields[i], ">", tmp_val,
-             "</", fields[i], ">", NULL);
+          out_xml_rec_cell(out, descs[i], val);
         }
         // Set res.status
-        if(strcmp(fields[i], STATUS_COL) == 0 && val != NULL){
+        if(descs[i]->role == ROLE_STATUS && val != NULL){
           ret->status = val;
         }
         // Set res.providerInfo
-        else if(strcmp(fields[i], PROVIDERINFO_COL) == 0 && val != NULL){
+        else if(descs[i]->role == ROLE_PROVIDERINFO && val != NULL){
           ret->providerInfo = val;
         }
       }
@@ -1161,56 +3257,71 @@ void rec_xml_format(apr_pool_t* p, ap_dbd_t* dbd, apr_dbd_results_t* res,
       ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, "WARNING: max number of rows reached by rec_xml_format.");
     }
 
-    rec = apr_pstrcat(p, rec, "\n</", rec_name, "> ", NULL);
-
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Returning record:");
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%s", rec);
+    out_puts(out, "\n</");
+    out_puts(out, rec_name);
+    out_puts(out, "> ");
+    out_finish(out);
+}
 
-    ret->res = rec;
+/**
+ * Stream the first record of res as a JSON object, or null if there is none.
+ * Like rec_xml_format, list fields become arrays.
+ */
+void rec_json_format(apr_pool_t* p, out_stream* out, ap_dbd_t* dbd, apr_dbd_results_t* res,
+   db_result* ret, const column_desc** descs){
+    apr_dbd_row_t* row;
+    const char* val;
+    int i;
+    int first = 1;
+    int cols = apr_dbd_num_cols(dbd->driver,res);
+    int rownum = 0;
 
+    while(rownum<MAX_SELECT_ROWS){
+      row = NULL;
+      if(apr_dbd_get_row(dbd->driver, p, res, &row, -1) != 0){
+        break;
+      }
+      /* we can't break out here or row won't get cleaned up */
+      if(rownum++ > 0){
+        continue;
+      }
+      out_puts(out, "{");
+      for(i = 0 ; i < cols ; i++){
+        val = apr_dbd_get_entry(dbd->driver, row, i);
+        out_json_cell(out, first, descs[i], val);
+        first = 0;
+        // Set res.status
+        if(descs[i]->role == ROLE_STATUS && val != NULL){
+          ret->status = (char*)val;
+        }
+        // Set res.providerInfo
+        else if(descs[i]->role == ROLE_PROVIDERINFO && val != NULL){
+          ret->providerInfo = (char*)val;
+        }
+      }
+      out_puts(out, "}");
+    }
+    if(rownum == 0){
+      out_puts(out, "null");
+    }
+    out_finish(out);
 }
 
 /**
- * Get job definition, job history or node information record - which is determined by 'query'.
+ * Get job definition, job history or node information record - which is determined by 'table_num'.
  */
 void get_rec(apr_pool_t* p, request_rec *r, char* uuid, db_result* ret, int table_num){
 
-    char* token;
-    char* subtoken1;
-    char* subtoken2;
-    char* last;
-    char* last1;
     ret->format = 0;
-    char* query = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-    char* fields_str = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-    char* fields_query = (char*)apr_pcalloc(p, 256 * sizeof(char*));
-    char** fields;
-    char* rec_name = (char*)apr_pcalloc(p, 8 * sizeof(char*));
-
-    switch(table_num){
-      case JOB_TABLE_NUM:
-        // Don't use snprintf here - it messes up with non-letters...
-        //snprintf(query, strlen(JOB_REC_SELECT_Q)+1, JOB_REC_SELECT_Q);
-        apr_cpystrn(query, JOB_REC_SELECT_Q, strlen(JOB_REC_SELECT_Q)+1);
-        apr_cpystrn(fields_query, JOB_REC_SHOW_F_Q, strlen(JOB_REC_SHOW_F_Q)+1);
-        sprintf(rec_name, "job");
-        break;
-      case HIST_TABLE_NUM:
-        apr_cpystrn(query, HIST_REC_SELECT_Q, strlen(HIST_REC_SELECT_Q)+1);
-        apr_cpystrn(fields_query, HIST_REC_SHOW_F_Q, strlen(HIST_REC_SHOW_F_Q)+1);
-        sprintf(rec_name, "job");
-        break;
-      case NODE_TABLE_NUM:
-        apr_cpystrn(query, NODE_REC_SELECT_Q, strlen(NODE_REC_SELECT_Q)+1);
-        apr_cpystrn(fields_query, NODE_REC_SHOW_F_Q, strlen(NODE_REC_SHOW_F_Q)+1);
-        sprintf(rec_name, "node");
-        break;
-      default:
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid path: %s", r->uri);
+    table_schema* schema;
+    char* rec_name = table_num == NODE_TABLE_NUM ? "node" : "job";
+
+    if(table_num < JOB_TABLE_NUM || table_num > NODE_TABLE_NUM){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid path: %s", r->uri);
+      return;
     }
 
-    apr_dbd_results_t* dbres = (apr_dbd_results_t*)apr_pcalloc(p, sizeof(apr_dbd_results_t*));
-    //apr_dbd_results_t* res = NULL;
+    apr_dbd_results_t* dbres = NULL;
 
     ap_dbd_t* dbd = dbd_acquire_fn(r);
     if(dbd == NULL){
@@ -1218,20 +3329,35 @@ void get_rec(apr_pool_t* p, request_rec *r, char* uuid, db_result* ret, int tabl
         return;
     }
 
-    if((fields=set_fields(p, dbd, fields_str, fields_query))==NULL){
+    if((schema=get_schema(r, p, dbd, table_num))==NULL){
       ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to get fields.");
       return;
     }
 
-    config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
-    if(conf->ps_ == NULL ||
-      apr_strnatcasecmp(conf->ps_, "On") != 0){
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "PrepareStatements not enabled, %s.", conf->ps_);
-      get_rec_s(p, dbd, dbres, uuid, query);
+    /* Look up jobs by the indexed uuid column when the table has it. */
+    apr_array_header_t* args = apr_array_make(p, 1, sizeof(const char*));
+    const char* where = rec_where(p, schema, table_num, uuid, args);
+
+    /* A GET may select the fields returned; others want the whole record. */
+    const char* wanted = r->method_number == M_GET && r->args ? get_arg(p, r->args, FIELDS_STR) : NULL;
+    projection* pr = make_projection(p, schema, wanted, 0, 0);
+    if(pr == NULL){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid fields: %s", wanted);
+      ret->http_status = HTTP_BAD_REQUEST;
+      return;
     }
-    else{
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "PrepareStatements enabled, %s.", conf->ps_);
-      get_rec_ps(p, dbd, dbres, uuid, table_num);
+
+    /* Reply 304 if the record has not changed since the client got it. */
+    if((ret->http_status = check_conditions(r, p, dbd,
+       apr_pstrcat(p, apr_psprintf(p, REC_VALIDATOR_Q, TABLE_NAMES[table_num]), where, NULL),
+       args, table_num, pr->select, 0)) != OK){
+      return;
+    }
+
+    if(stmt_select(r, p, dbd, &dbres,
+       apr_pstrcat(p, apr_psprintf(p, RECS_SELECT_Q, pr->select, TABLE_NAMES[table_num]), where, NULL),
+       args, 0) != 0){
+      dbres = NULL;
     }
 
     if(dbres == NULL){
@@ -1239,36 +3365,27 @@ void get_rec(apr_pool_t* p, request_rec *r, char* uuid, db_result* ret, int tabl
       return;
     }
 
-    if(r->args && countchr(r->args, "=") > 0){
-      char buffer[strlen(r->args)+1];
-      snprintf(buffer, strlen(r->args)+1, "%s", r->args);
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "args: %s", buffer);
-
-      for ((token = strtok_r(buffer, "&", &last)); token;
-         token = strtok_r(NULL, "&", &last)) {
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "token: %s", token);
-        subtoken1 = strtok_r(token, "=", &last1);
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "subtoken1: %s", subtoken1);
-        if(apr_strnatcmp(subtoken1, FORMAT_STR) == 0){
-          subtoken2 = strtok_r(NULL, "=", &last1);
-          if(apr_strnatcmp(subtoken2, TEXT_FORMAT_STR) == 0){
-            ret->format = TEXT_FORMAT;
-          }
-          else if(apr_strnatcmp(subtoken2, XML_FORMAT_STR) == 0){
-            ret->format = XML_FORMAT;
-          }
-          else{
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Format %s unknown.", subtoken2);
-            //return NULL;
-          }
-        }
-      }
+    ret->format = request_format(p, r);
+    /* update_rec only wants the status and owner of the record. */
+    if(r->method_number != M_GET){
+      ret->format = TEXT_FORMAT;
     }
     if(ret->format == TEXT_FORMAT){
-      rec_text_format(p, dbd, dbres, ret, fields);
+      rec_text_format(p, dbd, dbres, ret, pr->descs);
     }
     else if(ret->format == XML_FORMAT){
-      rec_xml_format(p, dbd, dbres, ret, fields, rec_name);
+      out_stream out;
+      out_init(&out, r, p);
+      set_format_content_type(r, ret->format);
+      rec_xml_format(p, &out, dbd, dbres, ret, pr->descs, rec_name, get_ctx(r)->xsl_dir);
+      ret->streamed = 1;
+    }
+    else if(ret->format == JSON_FORMAT){
+      out_stream out;
+      out_init(&out, r, p);
+      set_format_content_type(r, ret->format);
+      rec_json_format(p, &out, dbd, dbres, ret, pr->descs);
+      ret->streamed = 1;
     }
 
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Returning:");
@@ -1279,148 +3396,457 @@ void get_rec(apr_pool_t* p, request_rec *r, char* uuid, db_result* ret, int tabl
 
 }
 
-/* From http://www.wilsonmar.com/1strings.htm. */
-void ltrim( char * string, char * trim )
-{
-  while ( string[0] != '\0' && strchr ( trim, string[0] ) != NULL )
-  {
-    memmove( &string[0], &string[1], strlen(string) );
-  }
-}
-
-/* From The Apache Modules Book. */
-/* Parse PUT text data from a string. The input string is NOT preserved. */
-static apr_hash_t* parse_put_from_string(apr_pool_t* p, char* args){
-  apr_hash_t* tbl;
-  char* pair;
-  char* eq;
-  const char* delim = "\n";
-  const char* sep = ":";
-  char* last;
+/* Read the request body into pp, bucket by bucket. */
+static int read_input_from_put(apr_pool_t* p, request_rec* r, put_parser* pp){
+  int eos = 0;
+  apr_size_t count = 0;
+  apr_size_t len;
+  apr_status_t rv;
+  apr_bucket_brigade* bb;
+  apr_bucket* b;
+  const char* data;
 
-  if(args == NULL){
-    return NULL;
+  const char* clen = apr_table_get(r->headers_in, "Content-Length");
+  if(clen != NULL && apr_atoi64(clen) >= MAX_SIZE){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Request too big (%s bytes; limit %d).", clen, MAX_SIZE);
+    return HTTP_REQUEST_ENTITY_TOO_LARGE;
   }
 
-  tbl = apr_hash_make(p);
-
-  /* Split the input on "\n" */
-  for(pair = apr_strtok(args, delim, &last); pair != NULL;
-      pair = apr_strtok(NULL, delim, &last)){
-    for(eq = pair; *eq; ++eq){
-      if(*eq == '+'){
-        *eq = ' ';
-      }
+  bb = apr_brigade_create(p, r->connection->bucket_alloc);
+  do{
+    rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, HUGE_STRING_LEN);
+    if(rv != APR_SUCCESS){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, "Failed to read PUT input.");
+      return HTTP_INTERNAL_SERVER_ERROR;
     }
-    eq = strstr(pair, sep);
-    if(eq){
-      *eq++ = '\0';
-      ltrim(eq, " ");
-      ap_unescape_url(eq);
+    if(APR_BRIGADE_EMPTY(bb)){
+      break;
     }
-    else{
-      eq = "";
+    for(b = APR_BRIGADE_FIRST(bb);
+       b != APR_BRIGADE_SENTINEL(bb);
+       b = APR_BUCKET_NEXT(b)){
+      if(APR_BUCKET_IS_EOS(b)){
+        eos = 1;
+        break;
+      }
+      if(APR_BUCKET_IS_METADATA(b)){
+        continue;
+      }
+      rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+      if(rv != APR_SUCCESS){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, "Failed to read PUT input.");
+        return HTTP_INTERNAL_SERVER_ERROR;
+      }
+      count += len;
+      if(count > (apr_size_t)MAX_SIZE){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Request too big (more than %d bytes).", MAX_SIZE);
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+      }
+      put_parse(pp, data, len);
     }
-    ltrim(pair, " ");
-    ap_unescape_url(pair);
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "key: %s", pair);
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "value: %s", eq);
-    apr_hash_set(tbl, pair, APR_HASH_KEY_STRING, apr_pstrdup(p, eq));
+    apr_brigade_cleanup(bb);
+  } while(!eos);
+  put_parse_end(pp);
 
-  }
-  return tbl;
+  ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Read %d bytes", (int)count);
+
+  return OK;
 }
 
-/* From The Apache Modules Book. */
 static int parse_input_from_put(apr_pool_t* p, request_rec* r, apr_hash_t **form){
-  int bytes, eos;
-  apr_size_t count;
-  apr_status_t rv;
-  apr_bucket_brigade* bb;
-  apr_bucket_brigade* bbin;
-  char* buf;
-  apr_bucket* b;
+  put_parser pp;
+  int status;
+  put_parser_init(&pp, p, 0);
+  status = read_input_from_put(p, r, &pp);
+  if(status != OK){
+    return status;
+  }
+  *form = pp.recs->nelts > 0 ? APR_ARRAY_IDX(pp.recs, 0, apr_hash_t*) : apr_hash_make(p);
+  return OK;
+}
 
-  const char* clen = apr_table_get(r->headers_in, "Content-Length");
-  if(clen != NULL){
-    bytes = strtol(clen, NULL, 0);
-    if(bytes >= MAX_SIZE){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Request too big (%d bytes; limit %d).", bytes, MAX_SIZE);
-      return HTTP_REQUEST_ENTITY_TOO_LARGE;
+/**
+ * What a PUT writes:
+ * 0 -> no fields to be updated (except for lastModified),
+ * 1 -> only csStatus, nodeId or providerInfo to be updated,
+ * 2 -> other than csStatus, nodeId or providerInfo to be updated.
+ */
+static int put_kind(apr_hash_t* put_data){
+  apr_hash_index_t* index;
+  const void *k;
+  int status_only = 0;
+  for(index = apr_hash_first(NULL, put_data);
+     index; index = apr_hash_next(index)){
+    apr_hash_this(index, &k, NULL, NULL);
+    if(status_only == 0 && (apr_strnatcmp(k, STATUS_COL) == 0 ||
+       apr_strnatcmp(k, NODEID_COL) == 0 ||
+       apr_strnatcmp(k, PROVIDERINFO_COL) == 0)){
+      status_only = 1;
+    }
+    if(status_only < 2 && apr_strnatcmp(k, LASTMODIFIED_COL) != 0 &&
+       apr_strnatcmp(k, STATUS_COL) != 0 &&
+       apr_strnatcmp(k, PROVIDERINFO_COL) != 0 &&
+       apr_strnatcmp(k, NODEID_COL) != 0){
+      status_only = 2;
     }
   }
+  return status_only;
+}
+
+/* Whether a job with this status may only have csStatus, nodeId and providerInfo changed. */
+static int is_ready(const char* status){
+  return status && strlen(status)>0 && strstr(READY, status) != NULL;
+}
+
+/**
+ * Tell why the update of job uuid changed no row: HTTP_NOT_FOUND if there is no
+ * such job, DECLINED if it is ready and the update was not just of its status,
+ * OK if the job already had the values written.
+ */
+static int update_rec_unchanged(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, table_schema* schema,
+   char* uuid, int status_only){
+  apr_array_header_t* args = apr_array_make(p, 1, sizeof(const char*));
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row = NULL;
+  const char* status;
+  if(stmt_select_row(r, p, dbd, &res, &row,
+     apr_pstrcat(p, apr_psprintf(p, RECS_SELECT_Q, STATUS_COL, TABLE_NAMES[JOB_TABLE_NUM]),
+        rec_where(p, schema, JOB_TABLE_NUM, uuid, args), NULL), args) != 0){
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if(row == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "No such job: %s", uuid);
+    return HTTP_NOT_FOUND;
+  }
+  status = apr_dbd_get_entry(dbd->driver, row, 0);
+  if(status_only == 2 && is_ready(status)){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+       "For %s jobs, only changing csStatus, nodeId and providerInfo is allowed: %s", status, uuid);
+    return DECLINED;
+  }
+  return OK;
+}
+
+/**
+ * The DN of the client certificate, or NULL. Read from the SSL connection,
+ * rather than from the environment of a sub-request, which would run all
+ * access and auth hooks again.
+ */
+static const char* client_dn(request_rec* r){
+  const char* dn;
+  if(ssl_var_lookup_fn != NULL){
+    dn = ssl_var_lookup_fn(r->pool, r->server, r->connection, r, (char*)CLIENT_S_DN_STRING);
+  }
   else{
-    bytes = MAX_SIZE;
+    dn = apr_table_get(r->subprocess_env, CLIENT_S_DN_STRING);
+  }
+  return dn != NULL && *dn != '\0' ? dn : NULL;
+}
+
+/**
+ * Node owner cache
+ *
+ * The creator (providerInfo) of node records, as last seen by this process,
+ * for NodeOwnerCacheTTL seconds. Heartbeats of a node then need no lookup of
+ * the creator when they change nothing, and PUTs by others are refused
+ * without touching the database. When NodeOwnerCacheSize entries have been
+ * stored, the expired and then the oldest entries are dropped.
+ */
+
+typedef struct {
+  const char* owner;
+  apr_time_t expires;
+} node_owner;
+
+static struct {
+  /* Holds the entries; replaced when they are evicted. */
+  apr_pool_t* pool;
+  /* Parent of pool. */
+  apr_pool_t* parent;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t* mutex;
+#endif
+  apr_hash_t* owners;
+  /* Entries allocated from pool. */
+  int stored;
+  apr_uint32_t hits;
+  apr_uint32_t evictions;
+} node_owners;
+
+static void node_owner_init(apr_pool_t* pchild, server_rec* s){
+  apr_status_t rv = apr_pool_create(&node_owners.pool, pchild);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create node owner cache pool.");
+    return;
+  }
+  node_owners.parent = pchild;
+  node_owners.owners = apr_hash_make(node_owners.pool);
+#if APR_HAS_THREADS
+  rv = apr_thread_mutex_create(&node_owners.mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+  if(rv != APR_SUCCESS){
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create node owner cache mutex.");
   }
+#endif
+}
 
-  ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Buffer size: %d bytes", bytes);
+static void node_owner_lock(){
+#if APR_HAS_THREADS
+  if(node_owners.mutex != NULL){
+    apr_thread_mutex_lock(node_owners.mutex);
+  }
+#endif
+}
 
-  bb = apr_brigade_create(p, r->connection->bucket_alloc);
-  bbin = apr_brigade_create(p, r->connection->bucket_alloc);
-  count = 0;
+static void node_owner_unlock(){
+#if APR_HAS_THREADS
+  if(node_owners.mutex != NULL){
+    apr_thread_mutex_unlock(node_owners.mutex);
+  }
+#endif
+}
+
+static int cmp_times(const void* a, const void* b){
+  apr_time_t x = *(const apr_time_t*)a;
+  apr_time_t y = *(const apr_time_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Keep at most three quarters of size entries: the unexpired ones expiring last.
+ * A pool cannot free single entries, so those kept are copied to a new pool.
+ * Called with the lock held.
+ */
+static void node_owner_evict(int size, apr_time_t now){
+  int keep = size * 3 / 4;
+  int n = 0;
+  apr_time_t cutoff = now;
+  apr_time_t* expires;
+  apr_pool_t* pool;
+  apr_hash_t* owners;
+  apr_hash_index_t* index;
+  const void* k;
+  void* v;
+  node_owner* entry;
+  if(apr_pool_create(&pool, node_owners.parent) != APR_SUCCESS){
+    return;
+  }
+  /* The expiry time from which on entries are kept. */
+  expires = (apr_time_t*)apr_palloc(pool, (apr_hash_count(node_owners.owners) + 1) * sizeof(apr_time_t));
+  for(index = apr_hash_first(pool, node_owners.owners); index; index = apr_hash_next(index)){
+    apr_hash_this(index, NULL, NULL, &v);
+    if(((node_owner*)v)->expires > now){
+      expires[n++] = ((node_owner*)v)->expires;
+    }
+  }
+  if(n > keep){
+    qsort(expires, n, sizeof(apr_time_t), cmp_times);
+    cutoff = expires[n - keep];
+  }
+  owners = apr_hash_make(pool);
+  for(index = apr_hash_first(pool, node_owners.owners); index; index = apr_hash_next(index)){
+    apr_hash_this(index, &k, NULL, &v);
+    if(((node_owner*)v)->expires > now && ((node_owner*)v)->expires >= cutoff &&
+       (int)apr_hash_count(owners) < keep){
+      entry = (node_owner*)apr_palloc(pool, sizeof(node_owner));
+      entry->owner = apr_pstrdup(pool, ((node_owner*)v)->owner);
+      entry->expires = ((node_owner*)v)->expires;
+      apr_hash_set(owners, apr_pstrdup(pool, k), APR_HASH_KEY_STRING, entry);
+    }
+  }
+  node_owners.evictions += apr_hash_count(node_owners.owners) - apr_hash_count(owners);
+  apr_pool_destroy(node_owners.pool);
+  node_owners.pool = pool;
+  node_owners.owners = owners;
+  node_owners.stored = apr_hash_count(owners);
+}
+
+/* The remembered creator of node record id, copied to p, or NULL. */
+static const char* node_owner_get(apr_pool_t* p, request_rec* r, const char* id){
+  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
+  node_owner* entry;
+  const char* owner = NULL;
+  if(node_owners.pool == NULL || conf->node_owner_ttl_ == 0){
+    return NULL;
+  }
+  node_owner_lock();
+  entry = apr_hash_get(node_owners.owners, id, APR_HASH_KEY_STRING);
+  if(entry != NULL && r->request_time < entry->expires){
+    owner = apr_pstrdup(p, entry->owner);
+    ++node_owners.hits;
+  }
+  node_owner_unlock();
+  return owner;
+}
+
+static void node_owner_set(request_rec* r, const char* id, const char* owner){
+  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
+  int ttl = conf->node_owner_ttl_ >= 0 ? conf->node_owner_ttl_ : DEFAULT_NODE_OWNER_TTL;
+  int size = conf->node_owner_cache_size_ > 0 ? conf->node_owner_cache_size_ :
+     DEFAULT_NODE_OWNER_CACHE_SIZE;
+  node_owner* entry;
+  if(node_owners.pool == NULL || owner == NULL || ttl == 0){
+    return;
+  }
+  node_owner_lock();
+  if(node_owners.stored >= size){
+    node_owner_evict(size, r->request_time);
+  }
+  entry = apr_hash_get(node_owners.owners, id, APR_HASH_KEY_STRING);
+  if(entry == NULL || strcmp(entry->owner, owner) != 0){
+    entry = (node_owner*)apr_palloc(node_owners.pool, sizeof(node_owner));
+    entry->owner = apr_pstrdup(node_owners.pool, owner);
+    apr_hash_set(node_owners.owners, apr_pstrdup(node_owners.pool, id), APR_HASH_KEY_STRING, entry);
+    ++node_owners.stored;
+  }
+  entry->expires = r->request_time + apr_time_from_sec(ttl);
+  node_owner_unlock();
+}
+
+/**
+ * Create node record uuid from the sorted keys of put_data, or update it if it
+ * exists and was created by the client, in one statement. providerInfo is
+ * assigned last, as MySQL evaluates the ownership conditions of later
+ * assignments with the values of earlier ones.
+ */
+static int write_node(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, table_schema* schema,
+   char* uuid, const char** keys, int nkeys, apr_hash_t* put_data){
+  const char* dn = client_dn(r);
+  const char* cached = node_owner_get(p, r, uuid);
+  apr_array_header_t* vals = apr_array_make(p, nkeys + 1, sizeof(const char*));
+  apr_array_header_t* args;
+  const char* provider = NULL;
+  char* set = "";
+  char* update = apr_pstrcat(p, " ON DUPLICATE KEY UPDATE lastModified = IF(", NODE_OWNER_COND,
+     ", NOW(), lastModified)", NULL);
+  int nupdate = 1;
+  char* query;
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row = NULL;
+  const char* owner = NULL;
+  int nrows = 0;
+  int i;
+
+  if(cached != NULL && (dn == NULL || strcmp(dn, cached) != 0)){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+       "An existing nodeInformation record can only be changed by its creator %s <-> %s",
+       dn, cached);
+    return DECLINED;
+  }
 
-  do{
-    rv = ap_get_brigade(r->input_filters, bbin, AP_MODE_READBYTES, APR_BLOCK_READ, bytes);
-    if(rv != APR_SUCCESS){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to read PUT input.");
-      return HTTP_INTERNAL_SERVER_ERROR;
-    }
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Looping");
-    for(b = APR_BRIGADE_FIRST(bbin);
-       b != APR_BRIGADE_SENTINEL(bbin);
-       b = APR_BUCKET_NEXT(b)){
-      if(APR_BUCKET_IS_EOS(b) /* had to add this to avoid infinite loop: */|| b->length <= 0 || APR_BUCKET_IS_METADATA(b)){
-        eos = 1;
+  for(i = 0; i <= nkeys; ++i){
+    const char* key;
+    /* providerInfo goes last. */
+    if(i == nkeys){
+      if(provider == NULL){
         break;
       }
-      if(!APR_BUCKET_IS_METADATA(b)){
-        if(b->length != (apr_size_t)(-1)){
-          count += b->length;
-          if(count > MAX_SIZE){
-            apr_bucket_delete(b);
-          }
-        }
+      key = PROVIDERINFO_COL;
+    }
+    else{
+      key = keys[i];
+      /* The record is the one of the URL. */
+      if(strcmp(key, ID_COL) == 0){
+        continue;
       }
-      if(count <= MAX_SIZE){
-        APR_BUCKET_REMOVE(b);
-        APR_BRIGADE_INSERT_TAIL(bb, b);
+      if(strcmp(key, PROVIDERINFO_COL) == 0){
+        provider = apr_hash_get(put_data, key, APR_HASH_KEY_STRING);
+        continue;
       }
-      ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Read %d", (int)count);
     }
-  } while (!eos);
+    set = apr_pstrcat(p, set, ", ", key, " = %s", NULL);
+    APR_ARRAY_PUSH(vals, const char*) = apr_hash_get(put_data, key, APR_HASH_KEY_STRING);
+    update = apr_pstrcat(p, update, ", ", key, " = IF(", NODE_OWNER_COND, ", VALUES(",
+       key, "), ", key, ")", NULL);
+    ++nupdate;
+  }
 
-  /* Done with the data. Kill the request if we got too much. */
-  if(count > MAX_SIZE){
-    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Request too big (%d bytes; limit %d).", bytes, MAX_SIZE);
-    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+  if(schema->id_unique){
+    query = apr_pstrcat(p, NODE_REC_UPSERT_Q, set, update, NULL);
+    args = apr_array_make(p, vals->nelts + nupdate + 1, sizeof(const char*));
+    APR_ARRAY_PUSH(args, const char*) = uuid;
+    apr_array_cat(args, vals);
+    for(i = 0; i < nupdate; ++i){
+      APR_ARRAY_PUSH(args, const char*) = dn;
+    }
+  }
+  else{
+    /* Without a unique index on identifier, update the record if the client may, and
+       create it below if it is not there; upsert_node() holds NODE_LOCK_Q meanwhile. */
+    query = apr_pstrcat(p, NODE_REC_UPDATE_Q, set, ID_WHERE, " AND ", NODE_OWNER_COND, NULL);
+    args = apr_array_copy(p, vals);
+    APR_ARRAY_PUSH(args, const char*) = uuid;
+    APR_ARRAY_PUSH(args, const char*) = dn;
   }
 
-  /* Put the data in a buffer and parse it. */
-  buf = apr_palloc(p, count + 1);
-  rv = apr_brigade_flatten(bb, buf, &count);
-  if(rv != APR_SUCCESS){
-    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Error (flatten) reading form data.");
+  ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s, uuid: %s", query, uuid);
+  if(stmt_query(r, p, dbd, &nrows, query, args) != 0){
     return HTTP_INTERNAL_SERVER_ERROR;
   }
-  buf[count] = '\0';
-  *form = parse_put_from_string(p, buf);
-
+  /* 1: inserted, 2: updated, 0: refused, missing (without the index) or nothing
+     changed - find out which, unless the creator is known to be the client. */
+  if(nrows != 0){
+    /* The write was allowed, so a creator given is now the stored one. */
+    node_owner_set(r, uuid, provider != NULL ? provider : cached);
+    return OK;
+  }
+  if(cached != NULL){
+    return OK;
+  }
+  args = apr_array_make(p, 1, sizeof(const char*));
+  APR_ARRAY_PUSH(args, const char*) = uuid;
+  if(stmt_select_row(r, p, dbd, &res, &row, NODE_OWNER_Q, args) != 0){
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if(row == NULL){
+    if(schema->id_unique){
+      return OK;
+    }
+    args = apr_array_make(p, vals->nelts + 1, sizeof(const char*));
+    APR_ARRAY_PUSH(args, const char*) = uuid;
+    apr_array_cat(args, vals);
+    if(stmt_query(r, p, dbd, &nrows, apr_pstrcat(p, NODE_REC_UPSERT_Q, set, NULL), args) != 0){
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    node_owner_set(r, uuid, provider);
+    return OK;
+  }
+  owner = apr_dbd_get_entry(dbd->driver, row, 0);
+  node_owner_set(r, uuid, owner);
+  if(owner != NULL && (dn == NULL || strcmp(dn, owner) != 0)){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+       "An existing nodeInformation record can only be changed by its creator %s <-> %s",
+       dn, owner);
+    return DECLINED;
+  }
   return OK;
-
 }
 
-char* mk_sql_key_values(apr_pool_t* p, apr_hash_t *ht) {
-  char* tmp_query = "";
-  apr_hash_index_t *hi;
-  void *val;
-  const void *key;
-  //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "Adding key/value pairs to query %s", tmp_query);
-  for(hi = apr_hash_first(p, ht); hi; hi = apr_hash_next(hi)){
-    apr_hash_this(hi, &key, NULL, &val);
-    //ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, p, "%s --> %s", (char *) key, (char *) val);
-    tmp_query = apr_pstrcat(p, tmp_query, ", ", key, " = '", val, "'", NULL);
+/**
+ * Write node record uuid with write_node(). Without a unique index on identifier,
+ * its UPDATE and INSERT are two statements, so writes are serialized with a named
+ * lock - otherwise two first registrations of a node could both insert.
+ */
+static int upsert_node(request_rec* r, apr_pool_t* p, ap_dbd_t* dbd, table_schema* schema,
+   char* uuid, const char** keys, int nkeys, apr_hash_t* put_data){
+  apr_array_header_t* args = apr_array_make(p, 1, sizeof(const char*));
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row = NULL;
+  const char* locked;
+  int status;
+  if(schema->id_unique){
+    return write_node(r, p, dbd, schema, uuid, keys, nkeys, put_data);
+  }
+  if(stmt_select_row(r, p, dbd, &res, &row, NODE_LOCK_Q, args) != 0 || row == NULL ||
+     (locked = apr_dbd_get_entry(dbd->driver, row, 0)) == NULL || strcmp(locked, "1") != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to lock node records for %s.", uuid);
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  status = write_node(r, p, dbd, schema, uuid, keys, nkeys, put_data);
+  res = NULL;
+  if(stmt_select_row(r, p, dbd, &res, &row, NODE_UNLOCK_Q, args) != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to unlock node records.");
   }
-  return tmp_query;
+  return status;
 }
 
 int update_rec(apr_pool_t* p, request_rec *r, char* uuid, int table_num) {
@@ -1436,8 +3862,6 @@ int update_rec(apr_pool_t* p, request_rec *r, char* uuid, int table_num) {
   /* Determine the kind of update to be done. */
   apr_hash_index_t* index;
   char* update_query = "";
-  char* select_query = "";
-  db_result ret = {0, "", ""};
   const char* provider = NULL;
 
   switch(table_num){
@@ -1445,7 +3869,6 @@ int update_rec(apr_pool_t* p, request_rec *r, char* uuid, int table_num) {
          update_query = apr_pstrcat(p, update_query, JOB_REC_UPDATE_Q, NULL);
          break;
     case NODE_TABLE_NUM:
-         update_query = apr_pstrcat(p, update_query, NODE_REC_UPDATE_Q, NULL);
          break;
     default:
          ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid path: %s", r->uri);
@@ -1453,111 +3876,80 @@ int update_rec(apr_pool_t* p, request_rec *r, char* uuid, int table_num) {
          return DECLINED;
   }
 
+  ap_dbd_t* dbd = dbd_acquire_fn(r);
+  if(dbd == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to acquire database connection.");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  table_schema* schema = get_schema(r, p, dbd, table_num);
+  if(schema == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to get fields.");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* The keys go into the query text, so each must be a column of the table; the values
+     are passed separately. The keys are sorted so that the same set of fields always gives
+     the same statement. */
   int nrows;
-  /* 0 -> no fields to be updated (except for lastModified),
-     1 -> only csStatus, nodeId or providerInfo to be updated,
-     2 -> other than csStatus, nodeId or providerInfo to be updated. */
-  int status_only = 0;
+  int status_only = put_kind(put_data);
+  int nkeys = 0;
+  const char** keys = (const char**)apr_palloc(p, (apr_hash_count(put_data) + 1) * sizeof(char*));
   const void *k;
   void *v;
-  for(index = apr_hash_first(NULL, put_data);
+  int i;
+  for(index = apr_hash_first(p, put_data);
      index; index = apr_hash_next(index)){
     apr_hash_this(index, (const void**)&k, NULL, (void**)&v);
-    if(status_only == 0 && (apr_strnatcmp(k, STATUS_COL) == 0 ||
-       apr_strnatcmp(k, NODEID_COL) == 0 ||
-       apr_strnatcmp(k, PROVIDERINFO_COL) == 0)){
-      status_only = 1;
-    }
     if(apr_strnatcmp(k, PROVIDERINFO_COL) == 0 ){
       provider = v;
     }
-    if(status_only < 2 && apr_strnatcmp(k, LASTMODIFIED_COL) != 0 &&
-       apr_strnatcmp(k, STATUS_COL) != 0 &&
-       apr_strnatcmp(k, PROVIDERINFO_COL) != 0 &&
-       apr_strnatcmp(k, NODEID_COL) != 0){
-      status_only = 2;
-    }
     if(apr_strnatcmp(k, LASTMODIFIED_COL) != 0){
-      update_query = apr_pstrcat(p, update_query, ", ", ap_escape_html(p, k), " = '",
-                        ap_escape_html(p, v), "'", NULL);
+      if(!is_field(schema, k)){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No such field: %s", (const char*)k);
+        return HTTP_BAD_REQUEST;
+      }
+      keys[nkeys++] = k;
     }
   }
-
-  /* If someone is trying to update other jobDefintion fields than csStatus or
-     changing only lastModified, check if the job status starts with 'ready';
-     if it does, decline. */
-  if(table_num == JOB_TABLE_NUM && status_only == 2){
-    select_query = apr_pstrcat(p, select_query, JOB_REC_SELECT_Q, NULL);
-    get_rec(p, r, uuid, &ret, table_num);
-    if(&ret != NULL && ret.status && strlen(ret.status)>0 && strstr(READY, ret.status) != NULL){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-         "For %s jobs, only changing csStatus, nodeId and providerInfo is allowed. %i --> %s",
-         ret.status, status_only, update_query);
-      return DECLINED;
-    }
+  qsort(keys, nkeys, sizeof(char*), cmp_strings);
+  char* set = "";
+  apr_array_header_t* args = apr_array_make(p, nkeys + 1, sizeof(const char*));
+  for(i = 0; i < nkeys; ++i){
+    set = apr_pstrcat(p, set, ", ", keys[i], " = %s", NULL);
+    APR_ARRAY_PUSH(args, const char*) = apr_hash_get(put_data, keys[i], APR_HASH_KEY_STRING);
   }
-  /* If someone is trying to update a nodeInformation record they did not create, decline. */
-  else if(table_num == NODE_TABLE_NUM){
-    select_query = apr_pstrcat(p, select_query, NODE_REC_SELECT_Q, NULL);
-    get_rec(p, r, uuid, &ret, table_num);
-    if(&ret != NULL){
-      // Get the client DN
-      //request_rec* subreq = ap_sub_req_lookup_file("/dev/null", r, 0);
-      request_rec* subreq = ap_sub_req_lookup_uri(r->uri, r, 0);
-      const char* client_dn = apr_table_get(subreq->subprocess_env, CLIENT_S_DN_STRING);
-      if(ret.providerInfo && strcmp(client_dn, ret.providerInfo) != 0){
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-           "An existing nodeInformation record can only be changed by its creator %s <-> %s",
-           client_dn, ret.providerInfo);
-        return DECLINED;
-      }
+
+  /* Register or update a node. */
+  if(table_num == NODE_TABLE_NUM){
+    status = upsert_node(r, p, dbd, schema, uuid, keys, nkeys, put_data);
+    if(status == OK){
+      response_cache_invalidate(table_num);
     }
+    return status;
   }
 
   /* Now update the database record. */
-  config_rec* conf = (config_rec*)ap_get_module_config(r->per_dir_config, &gridfactory_module);
-  ap_dbd_t* dbd = dbd_acquire_fn(r);
-  if(dbd == NULL){
-    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to acquire database connection.");
+  /* Match jobs on the indexed uuid column when the table has it. */
+  update_query = apr_pstrcat(p, update_query, set, rec_where(p, schema, table_num, uuid, args), NULL);
+  /* Only csStatus, nodeId and providerInfo of ready jobs may be changed. Checking
+     this in the UPDATE itself leaves no window between the check and the write. */
+  if(status_only == 2){
+    update_query = apr_pstrcat(p, update_query, JOB_NOT_READY_COND, NULL);
+  }
+  ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s, uuid: %s", update_query, uuid);
+  ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Provider: %s", provider);
+  if(stmt_query(r, p, dbd, &nrows, update_query, args) != 0){
     return HTTP_INTERNAL_SERVER_ERROR;
   }
 
-  if(table_num == JOB_TABLE_NUM && conf->ps_ != NULL && apr_strnatcasecmp(conf->ps_, "On") == 0 &&
-     status_only == 0){
-    /* If no key is present, use prepared statement. */
-    apr_dbd_prepared_t* statement = apr_hash_get(dbd->prepared, LABEL1, APR_HASH_KEY_STRING);
-    if(statement == NULL){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "A prepared statement could not be found for putting job records.");
-    }
-    char* str = apr_pstrcat(p, "%/", uuid, NULL);
-    if(apr_dbd_pvquery(dbd->driver, p, dbd->handle, &nrows,
-       statement, str) != 0) {
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Query execution error for %s.", str);
-    }
-  }
-  else{
-    /* Otherwise, just use a normal query. */
-    // If a nodeInformation record does not exist, create it.
-    if(table_num == NODE_TABLE_NUM){
-      if(strcmp(ret.res, "") == 0){
-        update_query = apr_pstrcat(p, NODE_REC_INSERT_Q,
-           mk_sql_key_values(p, put_data), NULL);
-      }
-      else{
-        update_query = apr_pstrcat(p, update_query, " WHERE ", ID_COL, " = '", uuid, "'", NULL);
-      }
-    }
-    else{
-      update_query = apr_pstrcat(p, update_query, " WHERE ", ID_COL, " LIKE '%/", uuid, "'", NULL);
-    }
-    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s, uuid: %s", update_query, uuid);
-    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Provider: %s", provider);
-    if(apr_dbd_query(dbd->driver, dbd->handle, &nrows, update_query) != 0){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Query execution error in update_rec");
-      return HTTP_INTERNAL_SERVER_ERROR;
-    }
+  /* No job changed: it does not exist, it is ready, or the update changed nothing,
+     which MySQL does not count - find out which. */
+  if(nrows == 0){
+    return update_rec_unchanged(r, p, dbd, schema, uuid, status_only);
   }
 
+  response_cache_invalidate(table_num);
+
   /* If we return HTTP_CREATED, Apache spits out:
 
      <p>The server encountered an internal error or
@@ -1585,6 +3977,470 @@ int update_rec(apr_pool_t* p, request_rec *r, char* uuid, int table_num) {
 
 }
 
+/**
+ * POST /db/jobs/claim[?max=N&format=text|xml]
+ * Atomically mark up to N (default 1) ready jobs with the csStatus, nodeId and providerInfo
+ * of the request body and return them in the list format, with all the fields a node reads
+ * from a job record - as a GET of the record does. csStatus defaults to "requested".
+ * Jobs locked by concurrent claims are skipped, so two nodes never get the same job.
+ */
+int claim_recs(apr_pool_t* p, request_rec *r){
+
+  apr_hash_t* put_data = NULL;
+  apr_hash_index_t* index;
+  const void *k;
+  void *v;
+  char* update_query = apr_pstrcat(p, JOB_REC_UPDATE_Q, NULL);
+  apr_array_header_t* update_args = apr_array_make(p, 4, sizeof(const char*));
+  apr_array_header_t* claimed_args = apr_array_make(p, MAX_CLAIM, sizeof(const char*));
+  apr_array_header_t* ids;
+  const char* id_list = "NULL";
+  char* val;
+  int max = 1;
+  int format = TEXT_FORMAT;
+  int nrows = 0;
+  int nclaimed = 0;
+  int has_status = 0;
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row;
+  apr_dbd_transaction_t* trans = NULL;
+
+  int status = parse_input_from_put(p, r, &put_data);
+  if(status != OK){
+     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Error reading request body.");
+     return status;
+  }
+
+  if(r->args){
+    if((val = get_arg(p, r->args, MAX_STR)) != NULL){
+      max = atoi(val);
+    }
+  }
+  format = request_format(p, r);
+  if(max < 1 || max > MAX_CLAIM){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Can claim between 1 and %i jobs, not %i.", MAX_CLAIM, max);
+    return HTTP_BAD_REQUEST;
+  }
+
+  ap_dbd_t* dbd = dbd_acquire_fn(r);
+  if(dbd == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to acquire database connection.");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  table_schema* schema = get_schema(r, p, dbd, JOB_TABLE_NUM);
+  if(schema == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to get fields.");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* Only the fields that may be written to ready jobs can be set. */
+  for(index = apr_hash_first(p, put_data); index; index = apr_hash_next(index)){
+    apr_hash_this(index, &k, NULL, &v);
+    if(apr_strnatcmp(k, STATUS_COL) != 0 && apr_strnatcmp(k, NODEID_COL) != 0 &&
+       apr_strnatcmp(k, PROVIDERINFO_COL) != 0){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+         "Only csStatus, nodeId and providerInfo can be set when claiming jobs, not %s.", (char*)k);
+      return HTTP_BAD_REQUEST;
+    }
+    if(apr_strnatcmp(k, STATUS_COL) == 0){
+      has_status = 1;
+    }
+    update_query = apr_pstrcat(p, update_query, ", ", k, " = %s", NULL);
+    APR_ARRAY_PUSH(update_args, const char*) = v;
+  }
+  if(!has_status){
+    update_query = apr_pstrcat(p, update_query, ", ", STATUS_COL, " = %s", NULL);
+    APR_ARRAY_PUSH(update_args, const char*) = REQUESTED;
+  }
+  ids = apr_array_make(p, max, sizeof(const char*));
+
+  if(apr_dbd_transaction_start(dbd->driver, p, dbd->handle, &trans) != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to start transaction: %s",
+       apr_dbd_error(dbd->driver, dbd->handle, 0));
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* Lock the jobs to claim. All rows must be read before the next query. */
+  if(apr_dbd_select(dbd->driver, p, dbd->handle, &res, apr_psprintf(p, JOB_RECS_CLAIM_Q, max), 0) != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Query execution error in claim_recs: %s",
+       apr_dbd_error(dbd->driver, dbd->handle, 0));
+    apr_dbd_transaction_mode_set(dbd->driver, trans, APR_DBD_TRANSACTION_ROLLBACK);
+    apr_dbd_transaction_end(dbd->driver, p, trans);
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  for(row = NULL; apr_dbd_get_row(dbd->driver, p, res, &row, -1) == 0; row = NULL){
+    val = (char*)apr_dbd_get_entry(dbd->driver, row, 0);
+    if(val != NULL){
+      APR_ARRAY_PUSH(ids, const char*) = apr_pstrdup(p, val);
+    }
+  }
+  nclaimed = ids->nelts;
+
+  if(nclaimed > 0){
+    id_list = stmt_list(p, claimed_args, ids, "%s", ", ");
+    update_query = apr_pstrcat(p, update_query, " WHERE ", ID_COL, " IN (",
+       stmt_list(p, update_args, ids, "%s", ", "), ")", NULL);
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s", update_query);
+    if(stmt_query(r, p, dbd, &nrows, update_query, update_args) != 0){
+      apr_dbd_transaction_mode_set(dbd->driver, trans, APR_DBD_TRANSACTION_ROLLBACK);
+      apr_dbd_transaction_end(dbd->driver, p, trans);
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+  if(apr_dbd_transaction_end(dbd->driver, p, trans) != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to commit claim: %s",
+       apr_dbd_error(dbd->driver, dbd->handle, 0));
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Claimed %i jobs", nclaimed);
+  if(nclaimed > 0){
+    response_cache_invalidate(JOB_TABLE_NUM);
+  }
+
+  /* Return the whole claimed jobs; the node needs e.g. inputFileURLs and executable. */
+  projection* pr = make_projection(p, schema, NULL, 0, 1);
+  if(pr == NULL){
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  out_stream out;
+  out_init(&out, r, p);
+  set_format_content_type(r, format);
+  res = NULL;
+  if(stmt_select(r, p, dbd, &res, apr_psprintf(p, JOB_RECS_CLAIMED_Q, pr->select, id_list),
+     claimed_args, 0) != 0){
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if(format == XML_FORMAT){
+    recs_xml_format(p, &out, dbd, res, pr, JOB_TABLE_NUM, NULL);
+  }
+  else if(format == JSON_FORMAT){
+    recs_json_format(p, &out, dbd, res, pr, JOB_TABLE_NUM, NULL);
+  }
+  else{
+    recs_text_format(p, &out, dbd, res, pr, NULL);
+  }
+
+  return OK;
+}
+
+typedef struct {
+  /* UUID as given in the identifier field. */
+  char* uuid;
+  /* Full identifier, as found in the DB. */
+  const char* identifier;
+  apr_hash_t* data;
+  const char* result;
+} batch_rec;
+
+/* The fields a batch record sets, sorted; lastModified is set by the module. */
+static apr_array_header_t* batch_keys(apr_pool_t* p, apr_hash_t* data){
+  apr_array_header_t* keys = apr_array_make(p, apr_hash_count(data), sizeof(const char*));
+  apr_hash_index_t* index;
+  const void* k;
+  for(index = apr_hash_first(p, data); index; index = apr_hash_next(index)){
+    apr_hash_this(index, &k, NULL, NULL);
+    if(apr_strnatcmp(k, LASTMODIFIED_COL) != 0){
+      APR_ARRAY_PUSH(keys, const char*) = k;
+    }
+  }
+  qsort(keys->elts, keys->nelts, sizeof(const char*), cmp_strings);
+  return keys;
+}
+
+/**
+ * PUT /db/jobs/[?format=text|xml]
+ * Update many job records in one transaction. The body holds one record per block
+ * of "key: value" lines, blocks separated by an empty line; each record must have
+ * an identifier (the job UUID or URL). The same rules as for PUT /db/jobs/UUID apply.
+ * Records setting the same fields to the same values are updated with one statement,
+ * the statements in the order of their first records. A job can only be updated by one
+ * record of a batch; later records with the same identifier are invalid.
+ * Returns the result of each record: updated, notFound, refused (the job is ready)
+ * or invalid.
+ */
+int batch_update_recs(apr_pool_t* p, request_rec *r){
+
+  put_parser pp;
+  char* val;
+  char* query;
+  int format = TEXT_FORMAT;
+  int nrecs = 0;
+  int nrows = 0;
+  int n;
+  int i;
+  int j;
+  batch_rec* recs;
+  apr_hash_t* found = apr_hash_make(p);
+  apr_hash_t* statuses = apr_hash_make(p);
+  apr_hash_t* seen = apr_hash_make(p);
+  apr_hash_t* groups = apr_hash_make(p);
+  apr_array_header_t* group_order = apr_array_make(p, 8, sizeof(apr_array_header_t*));
+  apr_hash_index_t* index;
+  apr_array_header_t* keys;
+  apr_array_header_t* group;
+  apr_array_header_t* lock_vals = apr_array_make(p, 16, sizeof(const char*));
+  apr_array_header_t* args;
+  apr_array_header_t* ids;
+  apr_hash_t* data;
+  apr_dbd_results_t* res = NULL;
+  apr_dbd_row_t* row;
+  apr_dbd_transaction_t* trans = NULL;
+  const void *k;
+  void *v;
+
+  put_parser_init(&pp, p, 1);
+  int status = read_input_from_put(p, r, &pp);
+  if(status != OK){
+     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Error reading request body.");
+     return status;
+  }
+  format = request_format(p, r);
+
+  ap_dbd_t* dbd = dbd_acquire_fn(r);
+  if(dbd == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to acquire database connection.");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  table_schema* schema = get_schema(r, p, dbd, JOB_TABLE_NUM);
+  if(schema == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to get fields.");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  int by_uuid = schema->uuid_col_nr >= 0;
+
+  /* One record per block of lines. */
+  if(pp.recs->nelts > MAX_BATCH){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Too many records; limit %i.", MAX_BATCH);
+    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+  }
+  recs = (batch_rec*)apr_pcalloc(p, pp.recs->nelts * sizeof(batch_rec));
+  while(nrecs < pp.recs->nelts){
+    recs[nrecs].data = APR_ARRAY_IDX(pp.recs, nrecs, apr_hash_t*);
+    val = apr_hash_get(recs[nrecs].data, ID_COL, APR_HASH_KEY_STRING);
+    if(val == NULL || *val == '\0'){
+      recs[nrecs].uuid = "";
+      recs[nrecs].result = BATCH_INVALID;
+    }
+    else{
+      recs[nrecs].uuid = constructUUID(p, val);
+      apr_hash_set(recs[nrecs].data, ID_COL, APR_HASH_KEY_STRING, NULL);
+      /* Otherwise the result would depend on the order of the statements. */
+      if(apr_hash_get(seen, recs[nrecs].uuid, APR_HASH_KEY_STRING) != NULL){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Duplicate identifier %s.", recs[nrecs].uuid);
+        recs[nrecs].result = BATCH_INVALID;
+      }
+      apr_hash_set(seen, recs[nrecs].uuid, APR_HASH_KEY_STRING, recs[nrecs].uuid);
+      /* Only known columns can be set. */
+      for(index = apr_hash_first(p, recs[nrecs].data); index; index = apr_hash_next(index)){
+        apr_hash_this(index, &k, NULL, NULL);
+        if(!is_field(schema, k)){
+          ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Unknown field %s for %s.", (char*)k, recs[nrecs].uuid);
+          recs[nrecs].result = BATCH_INVALID;
+        }
+      }
+      if(recs[nrecs].result == NULL){
+        /* As in rec_where(): a '%' or '_' of the UUID must not match anything. */
+        APR_ARRAY_PUSH(lock_vals, const char*) = by_uuid ? recs[nrecs].uuid :
+           apr_pstrcat(p, "%/", like_escape(p, recs[nrecs].uuid), NULL);
+      }
+    }
+    ++nrecs;
+  }
+
+  if(apr_dbd_transaction_start(dbd->driver, p, dbd->handle, &trans) != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to start transaction: %s",
+       apr_dbd_error(dbd->driver, dbd->handle, 0));
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* Lock the records and get their status, with one query. */
+  if(lock_vals->nelts > 0){
+    args = apr_array_make(p, lock_vals->nelts, sizeof(const char*));
+    query = apr_psprintf(p, by_uuid ? JOB_RECS_LOCK_UUID_Q : JOB_RECS_LOCK_Q,
+       by_uuid ? stmt_list(p, args, lock_vals, "%s", ", ") :
+       stmt_list(p, args, lock_vals, apr_pstrcat(p, ID_COL, " LIKE %s", NULL), " OR "));
+    if(stmt_select(r, p, dbd, &res, query, args, 0) != 0){
+      apr_dbd_transaction_mode_set(dbd->driver, trans, APR_DBD_TRANSACTION_ROLLBACK);
+      apr_dbd_transaction_end(dbd->driver, p, trans);
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    for(row = NULL; apr_dbd_get_row(dbd->driver, p, res, &row, -1) == 0; row = NULL){
+      const char* entry = apr_dbd_get_entry(dbd->driver, row, 0);
+      const char* st = apr_dbd_get_entry(dbd->driver, row, 1);
+      const char* uuid_entry = by_uuid ? apr_dbd_get_entry(dbd->driver, row, 2) : NULL;
+      char* id;
+      char* uuid;
+      if(entry == NULL){
+        continue;
+      }
+      id = apr_pstrdup(p, entry);
+      /* Rows written before the uuid column was added may not have it set. */
+      uuid = uuid_entry != NULL && *uuid_entry != '\0' ? apr_pstrdup(p, uuid_entry) : constructUUID(p, id);
+      apr_hash_set(found, uuid, APR_HASH_KEY_STRING, id);
+      apr_hash_set(statuses, uuid, APR_HASH_KEY_STRING, st == NULL ? "" : apr_pstrdup(p, st));
+    }
+  }
+
+  /* Check each record and group it with the records making the same change. */
+  for(i = 0; i < nrecs; ++i){
+    if(recs[i].result != NULL){
+      continue;
+    }
+    recs[i].identifier = apr_hash_get(found, recs[i].uuid, APR_HASH_KEY_STRING);
+    if(recs[i].identifier == NULL){
+      recs[i].result = BATCH_NOT_FOUND;
+      continue;
+    }
+    /* No other record of the batch changes the job, so its status is that of the DB. */
+    if(put_kind(recs[i].data) == 2 &&
+       is_ready(apr_hash_get(statuses, recs[i].uuid, APR_HASH_KEY_STRING))){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+         "For ready jobs, only changing csStatus, nodeId and providerInfo is allowed: %s", recs[i].uuid);
+      recs[i].result = BATCH_REFUSED;
+      continue;
+    }
+    /* The group key: each field, the length of its value and the value. */
+    keys = batch_keys(p, recs[i].data);
+    query = "";
+    for(j = 0; j < keys->nelts; ++j){
+      v = apr_hash_get(recs[i].data, APR_ARRAY_IDX(keys, j, const char*), APR_HASH_KEY_STRING);
+      query = apr_pstrcat(p, query, APR_ARRAY_IDX(keys, j, const char*), "\t",
+         apr_ltoa(p, strlen((char*)v)), "\t", (char*)v, NULL);
+    }
+    group = apr_hash_get(groups, query, APR_HASH_KEY_STRING);
+    if(group == NULL){
+      group = apr_array_make(p, 8, sizeof(batch_rec*));
+      apr_hash_set(groups, query, APR_HASH_KEY_STRING, group);
+      APR_ARRAY_PUSH(group_order, apr_array_header_t*) = group;
+    }
+    APR_ARRAY_PUSH(group, batch_rec*) = &recs[i];
+  }
+
+  /* One UPDATE per group. */
+  for(i = 0; i < group_order->nelts; ++i){
+    group = APR_ARRAY_IDX(group_order, i, apr_array_header_t*);
+    /* The records of a group set the same fields to the same values as its first one. */
+    data = APR_ARRAY_IDX(group, 0, batch_rec*)->data;
+    keys = batch_keys(p, data);
+    args = apr_array_make(p, keys->nelts + group->nelts, sizeof(const char*));
+    query = apr_pstrcat(p, JOB_REC_UPDATE_Q, NULL);
+    for(j = 0; j < keys->nelts; ++j){
+      query = apr_pstrcat(p, query, ", ", APR_ARRAY_IDX(keys, j, const char*), " = %s", NULL);
+      APR_ARRAY_PUSH(args, const char*) = apr_hash_get(data, APR_ARRAY_IDX(keys, j, const char*),
+         APR_HASH_KEY_STRING);
+    }
+    ids = apr_array_make(p, group->nelts, sizeof(const char*));
+    for(j = 0; j < group->nelts; ++j){
+      APR_ARRAY_PUSH(ids, const char*) = APR_ARRAY_IDX(group, j, batch_rec*)->identifier;
+    }
+    query = apr_pstrcat(p, query, " WHERE ", ID_COL, " IN (", stmt_list(p, args, ids, "%s", ", "), ")",
+       NULL);
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Query: %s", query);
+    if(stmt_query(r, p, dbd, &n, query, args) != 0){
+      apr_dbd_transaction_mode_set(dbd->driver, trans, APR_DBD_TRANSACTION_ROLLBACK);
+      apr_dbd_transaction_end(dbd->driver, p, trans);
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    for(j = 0; j < group->nelts; ++j){
+      APR_ARRAY_IDX(group, j, batch_rec*)->result = BATCH_UPDATED;
+    }
+    nrows += n;
+  }
+  if(apr_dbd_transaction_end(dbd->driver, p, trans) != 0){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to commit batch: %s",
+       apr_dbd_error(dbd->driver, dbd->handle, 0));
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Batch of %i records updated %i rows with %i statements",
+     nrecs, nrows, group_order->nelts);
+  if(nrows > 0){
+    response_cache_invalidate(JOB_TABLE_NUM);
+  }
+
+  /* Return the result of each record. */
+  out_stream out;
+  out_init(&out, r, p);
+  set_format_content_type(r, format);
+  if(format == XML_FORMAT){
+    out_puts(&out, "<?xml version=\"1.0\"?>\n<results>");
+    for(i = 0; i < nrecs; ++i){
+      out_puts(&out, "\n  <result>");
+      out_xml_elem(&out, "\n    ", ID_COL, recs[i].uuid);
+      out_xml_elem(&out, "\n    ", RESULT_STR, recs[i].result);
+      out_puts(&out, "\n  </result>");
+    }
+    out_puts(&out, "\n</results> ");
+  }
+  else if(format == JSON_FORMAT){
+    out_puts(&out, "{\"results\":[");
+    for(i = 0; i < nrecs; ++i){
+      out_puts(&out, i == 0 ? "\n{" : ",\n{");
+      out_json_field(&out, 1, ID_COL, recs[i].uuid);
+      out_json_field(&out, 0, RESULT_STR, recs[i].result);
+      out_puts(&out, "}");
+    }
+    out_puts(&out, "\n]}");
+  }
+  else{
+    out_puts(&out, ID_COL);
+    out_puts(&out, "\t");
+    out_puts(&out, RESULT_STR);
+    for(i = 0; i < nrecs; ++i){
+      out_puts(&out, "\n");
+      out_puts(&out, recs[i].uuid);
+      out_puts(&out, "\t");
+      out_puts(&out, recs[i].result);
+    }
+  }
+  out_finish(&out);
+
+  return OK;
+}
+
+/**
+ * GET /db/stats/: the counters of this Apache child, followed by those of the shared
+ * response cache, one "key: value" per line.
+ * POST /db/stats/?reload=schema makes the cached table schemas of all children be
+ * re-read on next use, and returns the same.
+ */
+static int stats_handler(request_rec *r) {
+  const char* reload = r->args ? get_arg(r->pool, r->args, RELOAD_STR) : NULL;
+  if(r->method_number != M_GET && r->method_number != M_POST){
+    r->allowed = (AP_METHOD_BIT << M_GET) | (AP_METHOD_BIT << M_POST);
+    return HTTP_METHOD_NOT_ALLOWED;
+  }
+  if(r->method_number == M_POST){
+    if(reload == NULL || strcmp(reload, RELOAD_SCHEMA_STR) != 0){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid POST to %s", r->uri);
+      return HTTP_BAD_REQUEST;
+    }
+    apr_atomic_inc32(schemas.generation);
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Schema reload requested.");
+  }
+  ap_set_content_type(r, "text/plain;charset=ascii");
+  ap_rprintf(r, "pid: %i\n", (int)getpid());
+  ap_rprintf(r, "schemaCacheHits: %u\n", schemas.hits);
+  ap_rprintf(r, "schemaCacheRefreshes: %u\n", schemas.refreshes);
+  ap_rprintf(r, "schemaGeneration: %u\n", apr_atomic_read32(schemas.generation));
+  ap_rprintf(r, "jobWatchPolls: %u\n", watch.polls);
+  ap_rprintf(r, "jobWatchWaiters: %i\n", watch.waiters);
+  ap_rprintf(r, "stmtCacheHits: %u\n", apr_atomic_read32(&stmt_hits));
+  ap_rprintf(r, "stmtCacheMisses: %u\n", apr_atomic_read32(&stmt_misses));
+  ap_rprintf(r, "stmtCacheEvictions: %u\n", apr_atomic_read32(&stmt_evictions));
+  ap_rprintf(r, "nodeOwnerCacheHits: %u\n", node_owners.hits);
+  ap_rprintf(r, "nodeOwnerCacheEvictions: %u", node_owners.evictions);
+  if(rcache.shm != NULL){
+    apr_global_mutex_lock(rcache.mutex);
+    ap_rprintf(r, "\nresponseCacheHits: %u\n", rcache.header->hits);
+    ap_rprintf(r, "responseCacheMisses: %u\n", rcache.header->misses);
+    ap_rprintf(r, "responseCacheStores: %u\n", rcache.header->stores);
+    ap_rprintf(r, "responseCacheEvictions: %u\n", rcache.header->evictions);
+    ap_rprintf(r, "responseCacheTooLarge: %u", rcache.header->too_large);
+    apr_global_mutex_unlock(rcache.mutex);
+  }
+  return OK;
+}
+
 /* From mod_ftpd. */
 /* Prevent mod_dir from adding directory indexes */
 static int fixup_path(request_rec *r)
@@ -1608,10 +4464,15 @@ static int request_handler(apr_pool_t *p, request_rec *r, int uri_len, int table
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "entering request_handler");
     /* GET */
     if(r->method_number == M_GET){
+      /* The format may be chosen by the Accept header. */
+      apr_table_mergen(r->headers_out, "Vary", "Accept");
       if(apr_strnatcmp((r->uri) + uri_len - job_dir_len, JOB_DIR) == 0 ||
          apr_strnatcmp((r->uri) + uri_len - hist_dir_len, HIST_DIR) == 0 ||
          apr_strnatcmp((r->uri) + uri_len - node_dir_len, NODE_DIR) == 0){
         /* GET /db/jobs|history|nodes/?... */
+        if(table_num == JOB_TABLE_NUM && wait_for_recs(p, r, table_num) == SUSPENDED){
+          return SUSPENDED;
+        }
         get_recs(r, p, &ret, PRIVATE, table_num);
       }
       /* GET /db/jobs|history|nodes/UUID */
@@ -1632,12 +4493,14 @@ static int request_handler(apr_pool_t *p, request_rec *r, int uri_len, int table
          ok = DECLINED;
       }
 
-      if(ret.format == 0){
-        ap_set_content_type(r, "text/plain;charset=ascii");
-        ap_rputs(ret.res, r);
+      if(ret.http_status != OK){
+        ok = ret.http_status;
+      }
+      else if(ret.streamed){
+        /* Already written by get_recs. */
       }
-      else if(ret.format == 1){
-        ap_set_content_type(r, "text/xml;charset=ascii");
+      else if(ret.format == TEXT_FORMAT || ret.format == XML_FORMAT){
+        set_format_content_type(r, ret.format);
         ap_rputs(ret.res, r);
       }
       else{
@@ -1651,6 +4514,12 @@ static int request_handler(apr_pool_t *p, request_rec *r, int uri_len, int table
      * --upload-file 3a86aacc-2d5f-11dd-80f2-c3b981785945 \
      * https://localhost/db/jobs/3a86aacc-2d5f-11dd-80f2-c3b981785945
      */
+    /* PUT /db/jobs/ */
+    else if(r->method_number == M_PUT && table_num == JOB_TABLE_NUM &&
+            apr_strnatcmp((r->uri) + uri_len - job_dir_len, JOB_DIR) == 0){
+      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Batch PUT %s", r->uri);
+      ok = batch_update_recs(p, r);
+    }
     else if(r->method_number == M_PUT){
       ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "PUT %s", r->uri);
       char* tmpstr = (char*)apr_pcalloc(p, sizeof(char*) * 256);
@@ -1679,8 +4548,14 @@ static int request_handler(apr_pool_t *p, request_rec *r, int uri_len, int table
       ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Content type: %s", r->content_type);
       ok = update_rec(p, r, this_uuid, table_num);
     }
+    /* POST /db/jobs/claim */
+    else if(r->method_number == M_POST && table_num == JOB_TABLE_NUM &&
+            uri_len > strlen(CLAIM_STR) && strcmp(r->uri + uri_len - strlen(CLAIM_STR), CLAIM_STR) == 0){
+      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "POST %s", r->uri);
+      ok = claim_recs(p, r);
+    }
     else{
-      r->allowed = (apr_int64_t) ((1 < M_GET) | (1 < M_PUT));
+      r->allowed = (AP_METHOD_BIT << M_GET) | (AP_METHOD_BIT << M_PUT) | (AP_METHOD_BIT << M_POST);
     }
 
     return ok;
@@ -1724,6 +4599,11 @@ static int gridfactory_db_handler(request_rec *r) {
 
     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "URI: %s", r->uri);
 
+    if(uri_len >= strlen(STATS_DIR) && strcmp(r->uri + uri_len - strlen(STATS_DIR), STATS_DIR) == 0){
+      apr_pool_destroy(p);
+      return stats_handler(r);
+    }
+
     base_path = (char*)apr_pcalloc(p, sizeof(char*) * 256);
     main_path = (char*)apr_pcalloc(p, sizeof(char*) * 256);
     apr_cpystrn(base_path, r->uri, uri_len + 1);
@@ -1760,37 +4640,27 @@ static int gridfactory_db_handler(request_rec *r) {
      * https://this.server/db/
      * With this, base_url will be set to one of
      * https://this.server/db/jobs/, https://this.server/db/history/, https://this.server/db/nodes/
+     * A suspended request is run again by wait_callback(); it keeps its context.
      */
-    base_url = (char*)apr_pcalloc(p, sizeof(char*) * 256);
-    if(conf->url_ == NULL || strcmp(conf->url_, "") == 0){
-      tmp_url = apr_pstrcat(p, "https://", r->server->server_hostname, NULL);
-      if(r->server->port && r->server->port != 443){
-        tmp_url = apr_pstrcat(p, tmp_url, ":", apr_itoa(p, r->server->port), NULL);
+    request_ctx* ctx = get_ctx(r);
+    if(ctx == NULL){
+      ctx = (request_ctx*)apr_pcalloc(r->pool, sizeof(request_ctx));
+      ctx->table_num = table_num;
+      if(conf->base_urls_[table_num] != NULL){
+        ctx->base_url = conf->base_urls_[table_num];
       }
-      base_url = apr_pstrcat(p, tmp_url, base_path, main_path, NULL);
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "DB base URL not set, defaulting base_url to %s, %s, %s",
-        base_url, base_path, r->uri);
-    }
-    else{
-      apr_cpystrn(base_url, conf->url_, strlen(conf->url_)+1);
-      base_url = apr_pstrcat(p, base_url, main_path, NULL);
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "DB base URL set to %s. Setting base_url to %s", conf->url_, base_url);
-    }
-
-    /**
-     * If XSLDirURL was not set in the preferences, default to
-     * ../../gridfactory/xsl/.
-     */
-    xsl_dir = (char*)apr_pcalloc(p, sizeof(char*) * 256);
-    if(conf->xsl_ == NULL || strcmp(conf->xsl_, "") == 0){
-      tmp_url = "/gridfactory/xsl/";
-      apr_cpystrn(xsl_dir, tmp_url, strlen(tmp_url)+1);
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "XSL directory URL not set, defaulting xsl_dir to %s, %s",
-        xsl_dir, r->uri);
-    }
-    else{
-      apr_cpystrn(xsl_dir, conf->xsl_, strlen(conf->xsl_)+1);
-      ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "DB base URL set to %s. Setting xsl_dir to %s", conf->xsl_, xsl_dir);
+      else{
+        tmp_url = apr_pstrcat(p, "https://", r->server->server_hostname, NULL);
+        if(r->server->port && r->server->port != 443){
+          tmp_url = apr_pstrcat(p, tmp_url, ":", apr_itoa(p, r->server->port), NULL);
+        }
+        ctx->base_url = apr_pstrcat(r->pool, tmp_url, base_path, main_path, NULL);
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "DB base URL not set, defaulting base_url to %s, %s, %s",
+          ctx->base_url, base_path, r->uri);
+      }
+      /* If XSLDirURL was not set in the preferences, default to /gridfactory/xsl/. */
+      ctx->xsl_dir = conf->xsl_ == NULL || strcmp(conf->xsl_, "") == 0 ? DEFAULT_XSL_DIR : conf->xsl_;
+      ap_set_module_config(r->request_config, &gridfactory_module, ctx);
     }
 
     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Request: %s", r->the_request);
@@ -1808,10 +4678,21 @@ static int gridfactory_db_handler(request_rec *r) {
     return ret;
 }
 
+static void child_init(apr_pool_t *pchild, server_rec *s)
+{
+  schema_cache_init(pchild, s);
+  node_owner_init(pchild, s);
+  watch_init(pchild, s);
+  response_cache_child_init(pchild, s);
+}
+
 static void register_hooks(apr_pool_t *p)
 {
   static const char * const fixupSucc[] = { "mod_dir.c", NULL };
 
+  ap_hook_pre_config(response_cache_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_post_config(response_cache_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_handler(gridfactory_db_handler, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_fixups(fixup_path, NULL, fixupSucc, APR_HOOK_LAST);
 
@@ -0,0 +1,39 @@
+--
+-- Schema upgrades for an existing GridFactory database. mod_gridfactory
+-- works without them, but slower - and node registration is then not
+-- atomic (see the last one). Apply with e.g.
+--
+--   mysql GridFactory < upgrade_schema.sql
+--
+
+-- Keyset pagination (?after=) orders by (lastModified, identifier).
+ALTER TABLE `jobDefinition` ADD INDEX `lastModified_identifier` (`lastModified`, `identifier`);
+ALTER TABLE `jobHistory` ADD INDEX `lastModified_identifier` (`lastModified`, `identifier`);
+ALTER TABLE `nodeInformation` ADD INDEX `lastModified_identifier` (`lastModified`, `identifier`);
+
+-- Exact, indexed lookup of single records by UUID, instead of
+-- identifier LIKE '%/<uuid>'. mod_gridfactory uses the uuid column
+-- when it exists. Requires MySQL >= 5.7 or MariaDB >= 10.2.
+ALTER TABLE `jobDefinition`
+  ADD COLUMN `uuid` VARCHAR(255) AS (SUBSTRING_INDEX(`identifier`, '/', -1)) STORED,
+  ADD INDEX `uuid` (`uuid`);
+ALTER TABLE `jobHistory`
+  ADD COLUMN `uuid` VARCHAR(255) AS (SUBSTRING_INDEX(`identifier`, '/', -1)) STORED,
+  ADD INDEX `uuid` (`uuid`);
+
+-- POST /db/jobs/claim picks the oldest ready jobs.
+ALTER TABLE `jobDefinition` ADD INDEX `csStatus_created` (`csStatus`, `created`);
+
+-- Node PUTs register or update the node in one INSERT ... ON DUPLICATE
+-- KEY UPDATE when identifier is unique. Without the index they update,
+-- then insert if nothing was there, and concurrent registrations of a
+-- node may leave duplicate rows. These are removed here, keeping the most
+-- recently modified row of each node, before the index is added. Stop
+-- Apache, or keep nodes from registering, while this runs.
+CREATE TABLE `nodeInformation_unique` LIKE `nodeInformation`;
+ALTER TABLE `nodeInformation_unique` ADD UNIQUE INDEX `identifier` (`identifier`);
+INSERT IGNORE INTO `nodeInformation_unique`
+  SELECT * FROM `nodeInformation` ORDER BY `lastModified` DESC;
+RENAME TABLE `nodeInformation` TO `nodeInformation_duplicates`,
+  `nodeInformation_unique` TO `nodeInformation`;
+DROP TABLE `nodeInformation_duplicates`;
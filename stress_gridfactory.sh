@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Concurrency stress test of a running mod_gridfactory.
+#
+#   ./stress_gridfactory.sh [-c clients] [-n requests] BASE_URL...
+#
+# e.g. ./stress_gridfactory.sh -c 32 -n 200 https://localhost/db https://localhost/db2
+#
+# Each client sends its requests to one of the BASE_URLs - e.g. two Locations
+# with SetHandler gridfactory - for one table and one set of fields, so that
+# concurrent requests differ in base URL, table and projection. Meanwhile one
+# more client keeps forcing schema reloads. Every response must have status 200,
+# the header line of exactly the requested fields, rows with that many
+# columns and a dbUrl of its own base URL and table, ending with the UUID of
+# the row's identifier. DBBaseURL must not be set, and BASE_URLs must use
+# https and the ServerName, which dbUrl is built from. The tables should not
+# be empty. Extra curl options, e.g. for certificates, can be given in CURL_OPTS.
+#
+
+CLIENTS=16
+REQUESTS=100
+while getopts c:n: opt; do
+  case $opt in
+    c) CLIENTS=$OPTARG ;;
+    n) REQUESTS=$OPTARG ;;
+    *) echo "Usage: $0 [-c clients] [-n requests] BASE_URL..." >&2; exit 2 ;;
+  esac
+done
+shift `expr $OPTIND - 1`
+if [ $# -eq 0 ]; then
+  echo "Usage: $0 [-c clients] [-n requests] BASE_URL..." >&2
+  exit 2
+fi
+NBASES=$#
+BASES="$*"
+
+TMP=`mktemp -d`
+trap 'rm -rf $TMP' EXIT
+
+# The table and fields of client $1.
+client_table(){
+  case `expr $1 % 3` in
+    0) echo jobs ;;
+    1) echo history ;;
+    2) echo nodes ;;
+  esac
+}
+client_fields(){
+  case `expr $1 / 3 % 2`/`client_table $1` in
+    0/nodes) echo "identifier,host" ;;
+    1/nodes) echo "host,lastModified,identifier" ;;
+    0/*) echo "identifier,csStatus" ;;
+    1/*) echo "csStatus,lastModified,identifier" ;;
+  esac
+}
+
+# Check the text listing $1 of the request for fields $2 from $3; print what is wrong.
+check_listing(){
+  awk -F'\t' -v fields="$2" -v prefix="$3" '
+    NR == 1 {
+      want = fields; gsub(",", "\t", want); want = want "\tdbUrl"
+      if($0 != want){ print "header \"" $0 "\", expected \"" want "\""; exit }
+      ncols = NF
+      for(i = 1; i <= NF; i++){ if($i == "identifier"){ idcol = i } }
+      next
+    }
+    NF != ncols { print "row " NR ": " NF " columns, expected " ncols; exit }
+    index($NF, prefix) != 1 { print "row " NR ": dbUrl " $NF " not under " prefix; exit }
+    idcol > 0 {
+      n = split($idcol, parts, "/")
+      if(prefix parts[n] != $NF){ print "row " NR ": dbUrl " $NF " for identifier " $idcol; exit }
+    }
+    END { if(NR == 0){ print "empty response" } }
+  ' "$1"
+}
+
+client(){
+  i=$1
+  base=`echo $BASES | cut -d" " -f\`expr $i % $NBASES + 1\``
+  table=`client_table $i`
+  fields=`client_fields $i`
+  n=0
+  while [ $n -lt $REQUESTS ]; do
+    out=$TMP/out.$i
+    status=`curl -s $CURL_OPTS -o $out -w '%{http_code}' "$base/$table/?format=text&fields=$fields&limit=50"`
+    if [ "$status" != 200 ]; then
+      echo "client $i: $base/$table/ status $status" >> $TMP/failures
+    else
+      err=`check_listing $out "$fields" "$base/$table/"`
+      if [ -n "$err" ]; then
+        echo "client $i: $base/$table/?fields=$fields: $err" >> $TMP/failures
+      fi
+    fi
+    n=`expr $n + 1`
+  done
+}
+
+# Replace the cached schemas while the clients read with them.
+reloader(){
+  while [ ! -f $TMP/done ]; do
+    curl -s $CURL_OPTS -o /dev/null -X POST "$1/stats/?reload=schema"
+  done
+}
+
+reloader $1 &
+reloader_pid=$!
+i=0
+pids=""
+while [ $i -lt $CLIENTS ]; do
+  client $i &
+  pids="$pids $!"
+  i=`expr $i + 1`
+done
+wait $pids
+touch $TMP/done
+wait $reloader_pid
+
+if [ -s $TMP/failures ]; then
+  sort $TMP/failures | head -20
+  echo "FAILED: `wc -l < $TMP/failures` of `expr $CLIENTS \* $REQUESTS` requests"
+  exit 1
+fi
+echo "OK: `expr $CLIENTS \* $REQUESTS` requests from $CLIENTS clients"
@@ -0,0 +1,203 @@
+/*******************************************************************************
+ * test_escape.c
+ *
+ * Checks esc_scan() of gridfactory_escape.h against a byte by byte scan with
+ * esc_candidate(), and xml_entity(). Built once per code path by
+ *
+ *   make test
+ *
+ * as test_escape_scalar (-DGRIDFACTORY_NO_SIMD), test_escape_sse2 (-msse2) and
+ * test_escape_avx2 (-mavx2). With the argument "bench", the throughput of
+ * esc_scan() is measured instead.
+ *
+ * Copyright (c) 2008 Frederik Orellana, Niels Bohr Institute,
+ * University of Copenhagen. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ *******************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gridfactory_escape.h"
+
+#if defined(GRIDFACTORY_AVX2)
+static const char* PATH = "avx2";
+#elif defined(GRIDFACTORY_SSE2)
+static const char* PATH = "sse2";
+#else
+static const char* PATH = "scalar";
+#endif
+
+/* Longest buffer of the exhaustive checks: more than two AVX2 blocks. */
+#define TEST_MAX_LEN 70
+
+/* Scans start at each offset up to this one, to cover every alignment of a block. */
+#define TEST_MAX_OFFSET 33
+
+/* Size of the buffers of the throughput benchmark. */
+#define BENCH_SIZE (16 * 1024 * 1024)
+
+static int failures = 0;
+
+static const char* ref_scan(const char* c, const char* end, int json){
+  while(c < end && !esc_candidate((unsigned char)*c, json)){
+    ++c;
+  }
+  return c;
+}
+
+/* Compare esc_scan() with ref_scan() from the first offsets of buf. */
+static void check(const char* what, const char* buf, size_t len){
+  const char* end = buf + len;
+  const char* c;
+  int json;
+  for(json = 0; json <= 1; ++json){
+    for(c = buf; c <= end && c <= buf + TEST_MAX_OFFSET; ++c){
+      if(esc_scan(c, end, json) != ref_scan(c, end, json)){
+        if(failures++ < 10){
+          fprintf(stderr, "%s: %s, json=%d, len %u, offset %u: got %d, expected %d\n", PATH, what,
+             json, (unsigned)len, (unsigned)(c - buf), (int)(esc_scan(c, end, json) - buf),
+             (int)(ref_scan(c, end, json) - buf));
+        }
+      }
+    }
+  }
+}
+
+/* Each special or boundary byte alone at each position of each length up to TEST_MAX_LEN. */
+static void test_edges(void){
+  static const unsigned char bytes[] = {
+    '&', '<', '>', '"', '\\', '\t', '\n', '\r', 0x01, 0x1f, 0x20, 0x7f,
+    0x80, 0x9f, 0xa0, 0xdc, 0xe2, 0xfe, 0xff
+  };
+  /* The unmarked bytes: plain, or all >= 0x80, as in UTF-8 text. */
+  static const unsigned char fill[] = {'a', 0xc3, 0xff};
+  char buf[TEST_MAX_LEN + 32];
+  size_t len, pos, b, f;
+  for(f = 0; f < sizeof(fill); ++f){
+    for(len = 0; len <= TEST_MAX_LEN; ++len){
+      memset(buf, fill[f], len);
+      check("fill", buf, len);
+      for(pos = 0; pos < len; ++pos){
+        for(b = 0; b < sizeof(bytes); ++b){
+          memset(buf, fill[f], len);
+          buf[pos] = (char)bytes[b];
+          check("byte", buf, len);
+          /* A second candidate later in the same block, and in the next one. */
+          if(pos + 15 < len){
+            buf[pos + 15] = '<';
+            check("two", buf, len);
+          }
+        }
+      }
+    }
+  }
+}
+
+/* Random buffers with candidates of varying density. */
+static void test_random(void){
+  char buf[TEST_MAX_LEN * 4];
+  size_t len, i;
+  int run, density;
+  srand(4711);
+  for(run = 0; run < 20000; ++run){
+    len = rand() % sizeof(buf);
+    density = 1 + rand() % 64;
+    for(i = 0; i < len; ++i){
+      buf[i] = rand() % density == 0 ? (char)(rand() % 256) : (char)(0x20 + rand() % 0x5f);
+    }
+    check("random", buf, len);
+  }
+}
+
+static void test_xml_entity(void){
+  int ch;
+  for(ch = 0; ch < 256; ++ch){
+    const char* ent = xml_entity((char)ch);
+    const char* want = ch == '&' ? "&amp;" : ch == '<' ? "&lt;" : ch == '>' ? "&gt;" :
+       ch == '\t' || ch == '\n' || ch == '\r' ? NULL : ch < 0x20 ? "" : NULL;
+    /* xml_entity() is only asked about bytes esc_scan() stopped at. */
+    if(!esc_candidate((unsigned char)ch, 0)){
+      continue;
+    }
+    if((ent == NULL) != (want == NULL) || (ent != NULL && strcmp(ent, want) != 0)){
+      fprintf(stderr, "%s: xml_entity(0x%02x) is %s\n", PATH, ch, ent == NULL ? "NULL" : ent);
+      ++failures;
+    }
+  }
+}
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Scan buf to its end, stopping at each candidate as out_xml_str() does. */
+static void bench_scan(const char* name, const char* buf, size_t len, int json, int runs){
+  const char* end = buf + len;
+  const char* c;
+  size_t found = 0;
+  double start = now();
+  double secs;
+  int i;
+  for(i = 0; i < runs; ++i){
+    for(c = buf; (c = esc_scan(c, end, json)) < end; ++c){
+      ++found;
+    }
+  }
+  secs = now() - start;
+  printf("%-8s %-28s %8.1f MB/s (%u stops)\n", PATH, name, (double)len * runs / secs / 1e6,
+     (unsigned)(found / runs));
+}
+
+static void bench(void){
+  char* buf = (char*)malloc(BENCH_SIZE);
+  size_t i;
+  for(i = 0; i < BENCH_SIZE; ++i){
+    buf[i] = 'a' + i % 26;
+  }
+  bench_scan("plain", buf, BENCH_SIZE, 0, 20);
+  bench_scan("plain json", buf, BENCH_SIZE, 1, 20);
+  /* A field separator every 64 bytes, as in lists and file mappings. */
+  for(i = 63; i < BENCH_SIZE; i += 64){
+    buf[i] = '\t';
+  }
+  bench_scan("tab every 64 bytes", buf, BENCH_SIZE, 0, 20);
+  /* Markup, as in stored XML snippets. */
+  for(i = 15; i < BENCH_SIZE; i += 16){
+    buf[i] = '<';
+  }
+  bench_scan("'<' every 16 bytes", buf, BENCH_SIZE, 0, 5);
+  free(buf);
+}
+
+int main(int argc, char** argv){
+#if defined(GRIDFACTORY_AVX2) && defined(__GNUC__)
+  if(!__builtin_cpu_supports("avx2")){
+    printf("%s: skipped, the CPU has no AVX2\n", PATH);
+    return 0;
+  }
+#endif
+  if(argc > 1 && strcmp(argv[1], "bench") == 0){
+    bench();
+    return 0;
+  }
+  test_edges();
+  test_random();
+  test_xml_entity();
+  if(failures > 0){
+    fprintf(stderr, "%s: %d failures\n", PATH, failures);
+    return 1;
+  }
+  printf("%s: ok\n", PATH);
+  return 0;
+}